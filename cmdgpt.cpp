@@ -24,47 +24,138 @@ SOFTWARE.
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <cstdlib>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <limits>
+#include <thread>
+#include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <iomanip>
+#include <iterator>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <condition_variable>
+#include <random>
+#include <array>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "httplib.h"
 #include "nlohmann/json.hpp"
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/ansicolor_sink.h"
-#include "spdlog/sinks/file_sinks.h"
+#include "spdlog/sinks/base_sink.h"
+#ifdef CMDGPT_WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
 using json = nlohmann::json;
 
 // The current version
-#define CMDGPT_VERSION "v0.1"  // Added this line
-
-// Preprocessor defines for constants
-#define DEFAULT_MODEL "gpt-4"
-#define DEFAULT_SYSTEM_PROMPT "You are a helpfull assitant!"
-#define DEFAULT_LOG_LEVEL spdlog::level::warn
-#define AUTHORIZATION_HEADER "Authorization"
-#define CONTENT_TYPE_HEADER "Content-Type"
-#define APPLICATION_JSON "application/json"
-#define SYSTEM_ROLE "system"
-#define USER_ROLE "user"
-#define MODEL_KEY "model"
-#define MESSAGES_KEY "messages"
-#define ROLE_KEY "role"
-#define CONTENT_KEY "content"
-#define CHOICES_KEY "choices"
-#define FINISH_REASON_KEY "finish_reason"
-#define URL "/v1/chat/completions"
-#define SERVER_URL "https://api.openai.com"
-#define EMPTY_RESPONSE_CODE -1
-#define HTTP_OK 200
-#define HTTP_BAD_REQUEST 400
-#define HTTP_UNAUTHORIZED 401
-#define HTTP_FORBIDDEN 403
-#define HTTP_NOT_FOUND 404
-#define HTTP_INTERNAL_SERVER_ERROR 500
-
-// Map of string log levels to spdlog::level::level_enum values
-const std::map<std::string, spdlog::level::level_enum> log_levels = {
+constexpr char CMDGPT_VERSION[] = "v0.1";
+
+// Defaults, usable wherever a C string or std::string is expected
+constexpr char DEFAULT_MODEL[] = "gpt-4";
+constexpr char DEFAULT_SYSTEM_PROMPT[] = "You are a helpfull assitant!";
+constexpr char SERVER_URL[] = "https://api.openai.com";
+constexpr auto DEFAULT_LOG_LEVEL = spdlog::level::warn;
+
+// Protocol constants
+constexpr std::string_view AUTHORIZATION_HEADER = "Authorization";
+constexpr std::string_view BEARER_PREFIX = "Bearer ";
+constexpr std::string_view CONTENT_TYPE_HEADER = "Content-Type";
+constexpr std::string_view APPLICATION_JSON = "application/json";
+constexpr std::string_view CONTENT_KEY = "content";
+constexpr std::string_view MESSAGE_KEY = "message";
+constexpr std::string_view CHOICES_KEY = "choices";
+constexpr std::string_view FINISH_REASON_KEY = "finish_reason";
+constexpr std::string_view DELTA_KEY = "delta";
+constexpr std::string_view ERROR_KEY = "error";
+constexpr std::string_view MODEL_KEY = "model";
+constexpr std::string_view USAGE_KEY = "usage";
+constexpr std::string_view PROMPT_TOKENS_KEY = "prompt_tokens";
+constexpr std::string_view COMPLETION_TOKENS_KEY = "completion_tokens";
+constexpr std::string_view PROMPT_TOKENS_DETAILS_KEY = "prompt_tokens_details";
+constexpr std::string_view CACHED_TOKENS_KEY = "cached_tokens";
+constexpr std::string_view URL = "/v1/chat/completions";
+constexpr char REMAINING_REQUESTS_HEADER[] = "x-ratelimit-remaining-requests";
+constexpr char REMAINING_TOKENS_HEADER[] = "x-ratelimit-remaining-tokens";
+constexpr char RESET_REQUESTS_HEADER[] = "x-ratelimit-reset-requests";
+constexpr char RESET_TOKENS_HEADER[] = "x-ratelimit-reset-tokens";
+constexpr char RETRY_AFTER_HEADER[] = "retry-after";
+
+// Pre-escaped JSON fragments of the chat request body:
+// {"model":M,"messages":[{"role":"system","content":S},{"role":"user","content":P}],"max_tokens":N}
+constexpr std::string_view REQUEST_MODEL_FRAGMENT = R"({"model":)";
+constexpr std::string_view REQUEST_SYSTEM_FRAGMENT = R"(,"messages":[{"role":"system","content":)";
+constexpr std::string_view REQUEST_USER_FRAGMENT = R"(},{"role":"user","content":)";
+constexpr std::string_view REQUEST_ASSISTANT_FRAGMENT = R"(},{"role":"assistant","content":)";
+constexpr std::string_view REQUEST_MESSAGES_END_FRAGMENT = R"(}])";
+constexpr std::string_view REQUEST_MAX_TOKENS_FRAGMENT = R"(,"max_tokens":)";
+constexpr std::string_view REQUEST_MAX_COMPLETION_TOKENS_FRAGMENT = R"(,"max_completion_tokens":)";
+constexpr std::string_view REQUEST_TEMPERATURE_FRAGMENT = R"(,"temperature":)";
+constexpr std::string_view REQUEST_STREAM_FRAGMENT = R"(,"stream":true,"stream_options":{"include_usage":true})";
+
+// A negative temperature leaves the sampling temperature to the server
+constexpr double SERVER_DEFAULT_TEMPERATURE = -1;
+constexpr double MAX_TEMPERATURE = 2;
+
+// Asks the model to continue a partial answer after a failed stream
+constexpr std::string_view CONTINUATION_PROMPT =
+    "Your previous answer was cut off. Continue it exactly where it stopped, without repeating anything.";
+constexpr int MAX_STREAM_CONTINUATIONS = 3;
+constexpr std::chrono::milliseconds CONTINUATION_BACKOFF{500};
+
+// Streaming: the end-of-stream event and the patterns of the delta fast path
+constexpr std::string_view STREAM_DONE_EVENT = "[DONE]";
+constexpr std::string_view STREAM_DELTA_PATTERN = R"("delta":{)";
+constexpr std::string_view STREAM_CONTENT_PATTERN = R"("content":)";
+constexpr std::string_view STREAM_OPEN_FINISH_PATTERN = R"("finish_reason":null)";
+
+// U+FFFD, substituted for invalid UTF-8
+constexpr std::string_view UTF8_REPLACEMENT_CHARACTER = "\xef\xbf\xbd";
+
+// Status codes
+constexpr int EXIT_USAGE_ERROR = 64;
+constexpr int EMPTY_RESPONSE_CODE = -1;
+constexpr int BUDGET_EXCEEDED_CODE = -2;
+constexpr int HTTP_OK = 200;
+constexpr int HTTP_BAD_REQUEST = 400;
+constexpr int HTTP_UNAUTHORIZED = 401;
+constexpr int HTTP_FORBIDDEN = 403;
+constexpr int HTTP_NOT_FOUND = 404;
+constexpr int HTTP_TOO_MANY_REQUESTS = 429;
+constexpr int HTTP_INTERNAL_SERVER_ERROR = 500;
+constexpr int HTTP_BAD_GATEWAY = 502;
+constexpr int HTTP_SERVICE_UNAVAILABLE = 503;
+constexpr int HTTP_GATEWAY_TIMEOUT = 504;
+
+// Table of string log levels to spdlog::level::level_enum values.
+// A plain array is constant-initialized, so nothing is built at program startup.
+struct LogLevelName {
+    std::string_view name;
+    spdlog::level::level_enum level;
+};
+constexpr LogLevelName log_levels[] = {
     {"TRACE", spdlog::level::trace},
     {"DEBUG", spdlog::level::debug},
     {"INFO", spdlog::level::info},
@@ -73,133 +164,3605 @@ const std::map<std::string, spdlog::level::level_enum> log_levels = {
     {"CRITICAL", spdlog::level::critical},
 };
 
-// Global logger variable accessible by all functions
-std::shared_ptr<spdlog::logger> gLogger;
+// How long a key stays out of rotation after a 429 that carries no reset hint
+constexpr std::chrono::seconds DEFAULT_RATE_LIMIT_BACKOFF{1};
+
+// Streamed output: write buffer size and the default bound on the delay buffering adds
+constexpr size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+constexpr std::chrono::milliseconds DEFAULT_FLUSH_LATENCY{15};
+
+// Generations can take minutes; the HTTP library's default read timeout is a few seconds.
+// A read timeout counts as a failed stream and is continued, so the 5 s default would spend
+// the continuations on any model that pauses before its first token.
+constexpr std::chrono::seconds READ_TIMEOUT{300};
+
+// Global logger variable accessible by all functions
+std::shared_ptr<spdlog::logger> gLogger;
+
+// Receives each piece of a streamed response as it arrives
+using DeltaHandler = std::function<void(std::string_view delta)>;
+
+/**
+ * @brief Prints the help message to the console.
+ */
+void print_help() {
+    std::cout << "Usage: cmdgpt [options] [prompt]\n"
+              << "       cmdgpt usage [--by model|day|tag] [--ledger FILE]\n"
+              << "       cmdgpt logcat [FILE...]\n"
+              << "       cmdgpt cache train-dict [--size KIB] [--cache-dir DIR]\n"
+              << "       cmdgpt cache import|export [--cache-dir DIR] [FILE...]\n"
+              << "Options:\n"
+              << "  -h, --help              Show this help message and exit\n"
+              << "  -k, --api_key KEY       Add KEY to the OpenAI API key pool (repeatable,\n"
+              << "                          or comma-separated)\n"
+              << "  -s, --sys_prompt PROMPT Set the system prompt to PROMPT\n"
+              << "  -l, --log_file FILE     Set the binary log file to FILE\n"
+              << "                          (default ~/.cmdgpt_log.bin, empty disables)\n"
+              << "  -m, --gpt_model MODEL   Set the GPT model to MODEL\n"
+              << "  -L, --log_level LEVEL   Set the log level to LEVEL\n"
+              << "                          (TRACE, DEBUG, INFO, WARN, ERROR, CRITICAL)\n"
+              << "      --stream            Print the response as it is generated\n"
+              << "      --flush-ms MS       Hold streamed output for at most MS milliseconds to\n"
+              << "                          batch writes (default 15, 0 writes at once)\n"
+              << "      --temperature T     Set the sampling temperature to T (0 to 2)\n"
+              << "  -c, --cache             Answer repeated prompts from the response cache\n"
+              << "      --cache-dir DIR     Keep the response cache in DIR (default ~/.cmdgpt_cache)\n"
+              << "      --cache-similarity S\n"
+              << "                          With --temperature 0, also answer prompts whose\n"
+              << "                          similarity to a cached one is at least S (0 to 1)\n"
+              << "  -u, --ledger FILE       Record token usage and cost in FILE\n"
+              << "                          (default ~/.cmdgpt_usage.ledger, empty disables)\n"
+              << "  -t, --tag TAG           Tag the usage records of this run with TAG\n"
+              << "      --max-cost USD      Do not spend more than USD dollars in this run\n"
+              << "      --max-tokens-total N\n"
+              << "                          Do not use more than N tokens in this run\n"
+              << "  -v, --version           Print the version of the program and exit\n"
+              << "prompt:\n"
+              << "  The text prompt to send to the OpenAI GPT API. If not provided, the program will read from stdin.\n"
+              << "usage:\n"
+              << "  Report the recorded token usage and cost, grouped by model (default), day or tag.\n"
+              << "logcat:\n"
+              << "  Print binary log files as text. Without FILE, prints the log and its rotated files.\n"
+              << "cache train-dict:\n"
+              << "  Train a zstd dictionary (default 112 KiB) on the cached answers and compress new\n"
+              << "  cache entries with it. Needs a build with CMDGPT_WITH_ZSTD.\n"
+              << "cache import|export:\n"
+              << "  Load prompt/answer pairs from JSONL files (or stdin) into the response cache, or\n"
+              << "  write the cache to stdout as JSONL. -m and -s set the model and system prompt of\n"
+              << "  imported lines that do not have one.\n";
+}
+
+/**
+ * @brief Looks up a log level by name.
+ * @param name The log level name (TRACE, DEBUG, INFO, WARN, ERROR, CRITICAL).
+ * @param level A reference that receives the matching level if the name is known.
+ * @return True if the name is a known log level, false otherwise.
+ */
+bool find_log_level(std::string_view name, spdlog::level::level_enum& level) {
+    // The level names start with distinct letters, so the first letter is a perfect hash
+    int index;
+    switch (name.empty() ? '\0' : name[0]) {
+        case 'T': index = 0; break;
+        case 'D': index = 1; break;
+        case 'I': index = 2; break;
+        case 'W': index = 3; break;
+        case 'E': index = 4; break;
+        case 'C': index = 5; break;
+        default: return false;
+    }
+    if (name != log_levels[index].name) {
+        return false;
+    }
+    level = log_levels[index].level;
+    return true;
+}
+
+/**
+ * @brief Checks the UTF-8 sequence starting at a lead byte.
+ * @param bytes The sequence, starting with a byte >= 0x80.
+ * @param available The number of bytes available from bytes on.
+ * @return The length of a valid sequence, 0 if the sequence is invalid, or -1 if it is a
+ *         valid start that is cut off by the end of the input.
+ */
+int utf8_sequence_length(const unsigned char* bytes, size_t available) {
+    const unsigned char lead = bytes[0];
+    int length;
+    unsigned char second_min = 0x80;
+    unsigned char second_max = 0xbf;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        length = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        // Reject overlong forms and UTF-16 surrogates
+        if (lead == 0xe0) {
+            second_min = 0xa0;
+        } else if (lead == 0xed) {
+            second_max = 0x9f;
+        }
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        // Reject overlong forms and code points above U+10FFFF
+        if (lead == 0xf0) {
+            second_min = 0x90;
+        } else if (lead == 0xf4) {
+            second_max = 0x8f;
+        }
+    } else {
+        return 0;
+    }
+    for (int i = 1; i < length; ++i) {
+        if (static_cast<size_t>(i) >= available) {
+            return -1;
+        }
+        const unsigned char min = i == 1 ? second_min : 0x80;
+        const unsigned char max = i == 1 ? second_max : 0xbf;
+        if (bytes[i] < min || bytes[i] > max) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Returns the length of the longest valid UTF-8 prefix of a string.
+ *
+ * ASCII, the common case, is skipped eight bytes at a time; only multi-byte sequences
+ * are checked one by one.
+ */
+size_t valid_utf8_prefix(std::string_view text) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    const size_t size = text.size();
+    size_t pos = 0;
+    while (pos < size) {
+        uint64_t word;
+        while (pos + sizeof(word) <= size) {
+            std::memcpy(&word, bytes + pos, sizeof(word));
+            if (word & 0x8080808080808080ULL) {
+                break;
+            }
+            pos += sizeof(word);
+        }
+        while (pos < size && bytes[pos] < 0x80) {
+            ++pos;
+        }
+        if (pos >= size) {
+            break;
+        }
+        const int length = utf8_sequence_length(bytes + pos, size - pos);
+        if (length <= 0) {
+            return pos;
+        }
+        pos += length;
+    }
+    return size;
+}
+
+/**
+ * @brief Replaces invalid UTF-8 in a string with U+FFFD replacement characters.
+ * @param text The string to repair in place. Valid input is left untouched and not copied.
+ * @return The number of replacement characters inserted.
+ */
+size_t repair_utf8(std::string& text) {
+    size_t pos = valid_utf8_prefix(text);
+    if (pos == text.size()) {
+        return 0;
+    }
+    std::string repaired;
+    repaired.reserve(text.size() + 16);
+    repaired.append(text, 0, pos);
+    size_t replacements = 0;
+    const auto* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    while (pos < text.size()) {
+        const size_t valid = valid_utf8_prefix(std::string_view(text).substr(pos));
+        repaired.append(text, pos, valid);
+        pos += valid;
+        if (pos >= text.size()) {
+            break;
+        }
+        repaired += UTF8_REPLACEMENT_CHARACTER;
+        ++replacements;
+        // A truncated sequence at the end is replaced as a whole, anything else byte by byte
+        pos = utf8_sequence_length(bytes + pos, text.size() - pos) < 0 ? text.size() : pos + 1;
+    }
+    text = std::move(repaired);
+    return replacements;
+}
+
+/**
+ * @brief Returns the length of a string without a multi-byte sequence cut off at its end.
+ *
+ * Used to hold back the start of a character that continues in the next piece of a stream.
+ */
+size_t utf8_complete_prefix(std::string_view text) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    // A cut-off sequence starts at most three bytes before the end
+    const size_t start = text.size() > 3 ? text.size() - 3 : 0;
+    for (size_t pos = text.size(); pos > start; --pos) {
+        const unsigned char byte = bytes[pos - 1];
+        if ((byte & 0xc0) != 0x80) {
+            if (byte >= 0x80 && utf8_sequence_length(bytes + pos - 1, text.size() - pos + 1) < 0) {
+                return pos - 1;
+            }
+            break;
+        }
+    }
+    return text.size();
+}
+
+/**
+ * @brief Appends a string to a buffer as a quoted and escaped JSON string.
+ * @param out The buffer to append to.
+ * @param str The string to escape. It is expected to be valid UTF-8.
+ */
+void append_json_string(std::string& out, std::string_view str) {
+    static constexpr char hex_digits[] = "0123456789abcdef";
+    out += '"';
+    size_t run_start = 0;
+    for (size_t i = 0; i < str.size(); ++i) {
+        const auto c = static_cast<unsigned char>(str[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        // Copy the unescaped run in one go, then the escape sequence
+        out.append(str.data() + run_start, i - run_start);
+        run_start = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                out += "\\u00";
+                out += hex_digits[c >> 4];
+                out += hex_digits[c & 0x0f];
+        }
+    }
+    out.append(str.data() + run_start, str.size() - run_start);
+    out += '"';
+}
+
+/**
+ * @brief Returns the fragment that sets the completion token limit for a model.
+ *
+ * Reasoning models (o1, o3, ... and gpt-5) reject max_tokens and need max_completion_tokens,
+ * which older models and other servers may not know.
+ * @param model The GPT model to use.
+ * @return The pre-escaped fragment, up to the number.
+ */
+std::string_view max_tokens_fragment(std::string_view model) {
+    const bool reasoning_model = (model.size() > 1 && model[0] == 'o' && std::isdigit(static_cast<unsigned char>(model[1]))) ||
+                                 model.substr(0, 5) == "gpt-5";
+    return reasoning_model ? REQUEST_MAX_COMPLETION_TOKENS_FRAGMENT : REQUEST_MAX_TOKENS_FRAGMENT;
+}
+
+/**
+ * @brief Serializes a chat completion request body from the pre-escaped fragments.
+ * @param model The GPT model to use.
+ * @param system_prompt The system prompt.
+ * @param prompt The user prompt.
+ * @param max_tokens The completion token limit, or 0 to leave it to the server.
+ * @param stream Whether to request a server-sent events stream.
+ * @param partial_response If not empty, the part of the answer received before a failure. It is
+ *                         sent back as an assistant message with a request to continue it.
+ * @param temperature The sampling temperature, or a negative value to leave it to the server.
+ * @return The JSON request body.
+ */
+std::string build_chat_request_body(std::string_view model, std::string_view system_prompt, std::string_view prompt, uint64_t max_tokens = 0, bool stream = false,
+                                    std::string_view partial_response = {}, double temperature = SERVER_DEFAULT_TEMPERATURE) {
+    const std::string_view max_tokens_field = max_tokens_fragment(model);
+    std::string body;
+    body.reserve(REQUEST_MODEL_FRAGMENT.size() + REQUEST_SYSTEM_FRAGMENT.size() + REQUEST_USER_FRAGMENT.size() +
+                 REQUEST_MESSAGES_END_FRAGMENT.size() + max_tokens_field.size() + REQUEST_TEMPERATURE_FRAGMENT.size() + REQUEST_STREAM_FRAGMENT.size() +
+                 model.size() + system_prompt.size() + prompt.size() + 40);
+    if (!partial_response.empty()) {
+        body.reserve(body.capacity() + REQUEST_ASSISTANT_FRAGMENT.size() + partial_response.size() +
+                     REQUEST_USER_FRAGMENT.size() + CONTINUATION_PROMPT.size() + 16);
+    }
+    body += REQUEST_MODEL_FRAGMENT;
+    append_json_string(body, model);
+    body += REQUEST_SYSTEM_FRAGMENT;
+    append_json_string(body, system_prompt);
+    body += REQUEST_USER_FRAGMENT;
+    append_json_string(body, prompt);
+    if (!partial_response.empty()) {
+        body += REQUEST_ASSISTANT_FRAGMENT;
+        append_json_string(body, partial_response);
+        body += REQUEST_USER_FRAGMENT;
+        append_json_string(body, CONTINUATION_PROMPT);
+    }
+    body += REQUEST_MESSAGES_END_FRAGMENT;
+    if (max_tokens > 0) {
+        body += max_tokens_field;
+        body += std::to_string(max_tokens);
+    }
+    if (temperature >= 0) {
+        char number[32];
+        std::snprintf(number, sizeof(number), "%g", temperature);
+        body += REQUEST_TEMPERATURE_FRAGMENT;
+        body += number;
+    }
+    if (stream) {
+        body += REQUEST_STREAM_FRAGMENT;
+    }
+    body += '}';
+    return body;
+}
+
+/**
+ * @brief Returns the value of the Authorization header for an API key.
+ */
+std::string bearer_authorization(const std::string& api_key) {
+    std::string authorization(BEARER_PREFIX);
+    authorization += api_key;
+    return authorization;
+}
+
+/**
+ * @brief Returns the calling thread's HTTP client for a server and API key, creating it on first use.
+ *
+ * The authorization header is built once and installed as the client's default header,
+ * so repeated requests through the same client do not rebuild it. Each thread owns its
+ * clients, and with them its TLS context, session and keep-alive connection, so threads
+ * never contend on a shared SSL_CTX or its session cache. OpenSSL 1.1+ needs no global
+ * locking callbacks, so nothing else is shared between threads.
+ * @param server_url The base URL of the API server.
+ * @param api_key The API key for the OpenAI GPT API.
+ * @return A reference to the client, valid for the lifetime of the calling thread.
+ */
+httplib::Client& get_api_client(const std::string& server_url, const std::string& api_key) {
+    thread_local std::map<std::pair<std::string, std::string>, std::unique_ptr<httplib::Client>> clients;
+    auto& cli = clients[{server_url, api_key}];
+    if (!cli) {
+        cli = std::make_unique<httplib::Client>(server_url);
+        // Keep the connection open so later requests skip the TCP and TLS handshakes
+        cli->set_keep_alive(true);
+        cli->set_read_timeout(READ_TIMEOUT.count(), 0);
+        cli->set_default_headers({{std::string(AUTHORIZATION_HEADER), bearer_authorization(api_key)}});
+    }
+    return *cli;
+}
+
+/**
+ * @brief Parses a rate-limit reset duration such as "20ms", "1s", "6m0s" or "1h2m3.5s".
+ * @param text The duration as sent in the x-ratelimit-reset-* headers.
+ * @return The duration, or zero if the text could not be parsed.
+ */
+std::chrono::milliseconds parse_reset_duration(const std::string& text) {
+    double total_ms = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t used = 0;
+        double value;
+        try {
+            value = std::stod(text.substr(pos), &used);
+        } catch (const std::exception&) {
+            return std::chrono::milliseconds::zero();
+        }
+        pos += used;
+        if (text.compare(pos, 2, "ms") == 0) {
+            total_ms += value;
+            pos += 2;
+        } else if (pos < text.size() && text[pos] == 'h') {
+            total_ms += value * 3600000;
+            ++pos;
+        } else if (pos < text.size() && text[pos] == 'm') {
+            total_ms += value * 60000;
+            ++pos;
+        } else if (pos < text.size() && text[pos] == 's') {
+            total_ms += value * 1000;
+            ++pos;
+        } else {
+            return std::chrono::milliseconds::zero();
+        }
+    }
+    return std::chrono::milliseconds(static_cast<long long>(total_ms));
+}
+
+/**
+ * @brief Rate-limit state of one API key, as last reported by the server.
+ */
+struct ApiKeyState {
+    std::string key;
+    long remaining_requests = -1;  // -1 while unknown
+    long remaining_tokens = -1;    // -1 while unknown
+    bool limited = false;          // ran out or got a 429, and no counts were reported since
+    std::chrono::steady_clock::time_point blocked_until;
+};
+
+/**
+ * @brief A pool of API keys that routes each request to the key with the most headroom.
+ *
+ * Every response updates the remaining request and token counts of the key it was sent
+ * with. A key that runs out, or gets a 429, is taken out of rotation until its limit
+ * resets, and ranks below every other key until the server reports its counts again.
+ * Keys that have not been used yet count as having unlimited headroom. Ties rotate
+ * through the keys from a random one, so separate runs do not all use the first key.
+ */
+class ApiKeyPool {
+public:
+    /**
+     * @brief Adds keys to the pool.
+     * @param keys One key, or several separated by commas. Empty entries are ignored.
+     */
+    void add(const std::string& keys) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t start = 0;
+        while (start <= keys.size()) {
+            size_t end = keys.find(',', start);
+            if (end == std::string::npos) {
+                end = keys.size();
+            }
+            if (end > start) {
+                ApiKeyState state;
+                state.key = keys.substr(start, end - start);
+                keys_.push_back(std::move(state));
+            }
+            start = end + 1;
+        }
+    }
+
+    /**
+     * @brief Removes all keys from the pool.
+     */
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        keys_.clear();
+    }
+
+    /**
+     * @return The number of keys in the pool.
+     */
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return keys_.size();
+    }
+
+    /**
+     * @brief Picks the key with the most headroom for the next request.
+     * @param key A reference to a string where the selected key will be stored.
+     * @return The index of the selected key, or -1 if every key is rate limited.
+     */
+    int acquire(std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto now = std::chrono::steady_clock::now();
+        int best = -1;
+        // Ties go to the key after the last one used; the first run starts at a random key
+        for (size_t n = 0; n < keys_.size(); ++n) {
+            const size_t i = (next_ + n) % keys_.size();
+            auto& state = keys_[i];
+            if (now < state.blocked_until) {
+                continue;
+            }
+            if (best < 0 || headroom(state) > headroom(keys_[best])) {
+                best = static_cast<int>(i);
+            }
+        }
+        if (best >= 0) {
+            auto& state = keys_[best];
+            // Account for the request now, so concurrent callers spread across keys
+            if (state.remaining_requests > 0) {
+                --state.remaining_requests;
+            }
+            key = state.key;
+            next_ = best + 1;
+        }
+        return best;
+    }
+
+    /**
+     * @brief Updates a key's rate-limit state from a server response.
+     * @param index The index returned by acquire().
+     * @param res The HTTP response received with that key.
+     */
+    void update(int index, const httplib::Response& res) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& state = keys_.at(index);
+        const auto now = std::chrono::steady_clock::now();
+        if (res.has_header(REMAINING_REQUESTS_HEADER)) {
+            state.remaining_requests = std::atol(res.get_header_value(REMAINING_REQUESTS_HEADER).c_str());
+            state.limited = false;
+        }
+        if (res.has_header(REMAINING_TOKENS_HEADER)) {
+            state.remaining_tokens = std::atol(res.get_header_value(REMAINING_TOKENS_HEADER).c_str());
+            state.limited = false;
+        }
+        if (state.remaining_requests == 0) {
+            block(state, now + parse_reset_duration(res.get_header_value(RESET_REQUESTS_HEADER)));
+        }
+        if (state.remaining_tokens == 0) {
+            block(state, now + parse_reset_duration(res.get_header_value(RESET_TOKENS_HEADER)));
+        }
+        if (res.status == HTTP_TOO_MANY_REQUESTS) {
+            auto backoff = std::chrono::duration_cast<std::chrono::milliseconds>(DEFAULT_RATE_LIMIT_BACKOFF);
+            // Only the delay-seconds form is used; an HTTP-date keeps the default
+            const std::string retry_after = res.get_header_value(RETRY_AFTER_HEADER);
+            char* end = nullptr;
+            const long seconds = std::strtol(retry_after.c_str(), &end, 10);
+            if (end != retry_after.c_str() && *end == '\0' && seconds >= 0) {
+                backoff = std::chrono::seconds(seconds);
+            }
+            block(state, now + backoff);
+        }
+    }
+
+private:
+    // Remaining tokens decide, remaining requests break ties; unknown counts as unlimited,
+    // except on a key that was limited, which stays last until the server reports counts
+    static std::pair<long, long> headroom(const ApiKeyState& state) {
+        constexpr long unlimited = std::numeric_limits<long>::max();
+        if (state.limited) {
+            return {-1, -1};
+        }
+        return {state.remaining_tokens < 0 ? unlimited : state.remaining_tokens,
+                state.remaining_requests < 0 ? unlimited : state.remaining_requests};
+    }
+
+    // Takes a key out of rotation; its counts are unknown again once it comes back
+    static void block(ApiKeyState& state, std::chrono::steady_clock::time_point until) {
+        if (until > state.blocked_until) {
+            state.blocked_until = until;
+        }
+        state.remaining_requests = -1;
+        state.remaining_tokens = -1;
+        state.limited = true;
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<ApiKeyState> keys_;
+    // Where acquire() starts looking; random, so separate runs do not all begin with key #1
+    size_t next_ = std::random_device{}();
+};
+
+/**
+ * @brief Price of a model family in US dollars per million tokens.
+ */
+struct ModelPrice {
+    std::string_view model_prefix;
+    double input;
+    double cached_input;
+    double output;
+};
+
+// Matched by prefix in order, so longer prefixes of the same family come first.
+// Prices are list prices at the time of writing; costs in the ledger are estimates.
+constexpr ModelPrice model_prices[] = {
+    {"gpt-5-nano", 0.05, 0.005, 0.40},
+    {"gpt-5-mini", 0.25, 0.025, 2.00},
+    {"gpt-5", 1.25, 0.125, 10.00},
+    {"gpt-4o-mini", 0.15, 0.075, 0.60},
+    {"gpt-4o", 2.50, 1.25, 10.00},
+    {"gpt-4.1-nano", 0.10, 0.025, 0.40},
+    {"gpt-4.1-mini", 0.40, 0.10, 1.60},
+    {"gpt-4.1", 2.00, 0.50, 8.00},
+    {"gpt-4-turbo", 10.00, 10.00, 30.00},
+    {"gpt-4-32k", 60.00, 60.00, 120.00},
+    {"gpt-4", 30.00, 30.00, 60.00},
+    {"gpt-3.5-turbo", 0.50, 0.50, 1.50},
+    {"o4-mini", 1.10, 0.275, 4.40},
+    {"o3-mini", 1.10, 0.55, 4.40},
+    {"o3-pro", 20.00, 20.00, 80.00},
+    {"o3", 2.00, 0.50, 8.00},
+    {"o1-mini", 1.10, 0.55, 4.40},
+    {"o1", 15.00, 7.50, 60.00},
+};
+
+/**
+ * @brief Looks up the price of a model.
+ * @param model The model name, e.g. "gpt-4o-2024-08-06".
+ * @return The price of the model's family, or nullptr if it is not known.
+ */
+const ModelPrice* find_model_price(std::string_view model) {
+    for (const auto& price : model_prices) {
+        if (model.substr(0, price.model_prefix.size()) == price.model_prefix) {
+            return &price;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Estimates the cost of a request.
+ * @param model The model that served the request.
+ * @param prompt_tokens The number of prompt tokens, including cached ones.
+ * @param cached_tokens The number of prompt tokens served from the prompt cache.
+ * @param completion_tokens The number of completion tokens.
+ * @return The cost in millionths of a US dollar, or 0 for models without a known price.
+ */
+uint64_t estimate_cost_micro_usd(std::string_view model, uint64_t prompt_tokens, uint64_t cached_tokens, uint64_t completion_tokens) {
+    const ModelPrice* price = find_model_price(model);
+    if (!price) {
+        return 0;
+    }
+    // A price per million tokens in dollars is a price per token in micro-dollars
+    const uint64_t uncached_tokens = prompt_tokens > cached_tokens ? prompt_tokens - cached_tokens : 0;
+    return static_cast<uint64_t>(uncached_tokens * price->input + cached_tokens * price->cached_input +
+                                 completion_tokens * price->output + 0.5);
+}
+
+/**
+ * @brief Estimates the number of prompt tokens of a chat request without a tokenizer.
+ *
+ * English prose averages about four bytes per token, but code, numbers and JSON are
+ * denser. The estimate assumes three bytes per token for ASCII text and two for other
+ * UTF-8 text, plus the per-message overhead of the chat format, so that it errs high
+ * for most input. It is not a bound: text such as base64 or long digit runs can take
+ * more tokens. Only the usage the server reports is charged to the budget.
+ * @param messages The contents of the request's messages.
+ * @return The estimated number of prompt tokens.
+ */
+uint64_t estimate_prompt_tokens(std::initializer_list<std::string_view> messages) {
+    // Each message costs about 4 tokens of framing, and the reply is primed with 3 more
+    constexpr uint64_t message_overhead = 4;
+    constexpr uint64_t reply_overhead = 3;
+    uint64_t ascii_bytes = 0;
+    uint64_t other_bytes = 0;
+    for (std::string_view text : messages) {
+        for (const char c : text) {
+            if (static_cast<unsigned char>(c) < 0x80) {
+                ++ascii_bytes;
+            } else {
+                ++other_bytes;
+            }
+        }
+    }
+    return (ascii_bytes + 2) / 3 + (other_bytes + 1) / 2 + messages.size() * message_overhead + reply_overhead;
+}
+
+// Usage ledger file layout: a LedgerHeader followed by fixed-size LedgerRecords in host byte order
+constexpr char LEDGER_MAGIC[8] = {'C', 'G', 'P', 'T', 'L', 'D', 'G', 'R'};
+constexpr uint32_t LEDGER_VERSION = 1;
+
+struct LedgerHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct LedgerRecord {
+    int64_t timestamp_ms;         // Unix time of the request in milliseconds
+    uint32_t prompt_tokens;
+    uint32_t completion_tokens;
+    uint32_t cached_tokens;
+    uint32_t latency_ms;
+    uint64_t cost_micro_usd;
+    char model[32];               // NUL-padded, truncated if longer
+    char tag[32];                 // NUL-padded, truncated if longer
+};
+static_assert(sizeof(LedgerHeader) == 16, "ledger header layout must not change");
+static_assert(sizeof(LedgerRecord) == 96, "ledger record layout must not change");
+
+/**
+ * @brief Aggregated token usage and cost.
+ */
+struct UsageTotals {
+    uint64_t requests = 0;
+    uint64_t prompt_tokens = 0;
+    uint64_t completion_tokens = 0;
+    uint64_t cached_tokens = 0;
+    uint64_t latency_ms = 0;
+    uint64_t cost_micro_usd = 0;
+
+    void add(const LedgerRecord& record) {
+        ++requests;
+        prompt_tokens += record.prompt_tokens;
+        completion_tokens += record.completion_tokens;
+        cached_tokens += record.cached_tokens;
+        latency_ms += record.latency_ms;
+        cost_micro_usd += record.cost_micro_usd;
+    }
+
+    void add(const UsageTotals& other) {
+        requests += other.requests;
+        prompt_tokens += other.prompt_tokens;
+        completion_tokens += other.completion_tokens;
+        cached_tokens += other.cached_tokens;
+        latency_ms += other.latency_ms;
+        cost_micro_usd += other.cost_micro_usd;
+    }
+};
+
+/**
+ * @brief Narrows a count to a 32-bit ledger field, saturating at the largest value.
+ */
+uint32_t saturate_u32(uint64_t value) {
+    return static_cast<uint32_t>(std::min<uint64_t>(value, std::numeric_limits<uint32_t>::max()));
+}
+
+/**
+ * @brief Returns a fixed-size, NUL-padded field of a ledger record as a string view.
+ */
+template <size_t N>
+std::string_view ledger_field(const char (&field)[N]) {
+    return std::string_view(field, strnlen(field, N));
+}
+
+/**
+ * @brief Append-only binary ledger of per-request token usage and cost.
+ *
+ * Each request is appended as one fixed-size record with a single write() under an
+ * exclusive flock(), so concurrent cmdgpt processes can share a ledger. The totals of
+ * the records written by this process are also kept in memory.
+ */
+class UsageLedger {
+public:
+    /**
+     * @param path The ledger file. It is created with a header if it does not exist.
+     * @param tag A free-form tag stored with every record, e.g. a project name.
+     */
+    UsageLedger(std::string path, std::string tag) : path_(std::move(path)), tag_(std::move(tag)) {}
+
+    /**
+     * @brief Appends a record to the ledger and adds it to the in-memory totals.
+     * @return True if the record was written to the ledger file.
+     */
+    bool record(std::string_view model, uint64_t prompt_tokens, uint64_t completion_tokens, uint64_t cached_tokens,
+                std::chrono::milliseconds latency) {
+        LedgerRecord record{};
+        record.timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        // The record's 32-bit fields saturate rather than wrap; the cost uses the full counts
+        record.prompt_tokens = saturate_u32(prompt_tokens);
+        record.completion_tokens = saturate_u32(completion_tokens);
+        record.cached_tokens = saturate_u32(cached_tokens);
+        record.latency_ms = saturate_u32(static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0)));
+        record.cost_micro_usd = estimate_cost_micro_usd(model, prompt_tokens, cached_tokens, completion_tokens);
+        model.copy(record.model, sizeof(record.model));
+        std::string_view(tag_).copy(record.tag, sizeof(record.tag));
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            totals_.add(record);
+        }
+        return append(record);
+    }
+
+    /**
+     * @return The totals of all records written by this process.
+     */
+    UsageTotals totals() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return totals_;
+    }
+
+private:
+    bool append(const LedgerRecord& record) {
+        const int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = flock(fd, LOCK_EX) == 0;
+        struct stat st;
+        if (ok && fstat(fd, &st) == 0) {
+            if (st.st_size == 0) {
+                LedgerHeader header{};
+                std::memcpy(header.magic, LEDGER_MAGIC, sizeof(header.magic));
+                header.version = LEDGER_VERSION;
+                header.record_size = sizeof(LedgerRecord);
+                ok = write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+            } else if (static_cast<size_t>(st.st_size) >= sizeof(LedgerHeader) &&
+                       (st.st_size - sizeof(LedgerHeader)) % sizeof(LedgerRecord) != 0) {
+                // Drop a torn record left by an interrupted writer, so the records stay aligned
+                ok = ftruncate(fd, st.st_size - (st.st_size - sizeof(LedgerHeader)) % sizeof(LedgerRecord)) == 0;
+            }
+        }
+        if (ok) {
+            const ssize_t written = write(fd, &record, sizeof(record));
+            ok = written == static_cast<ssize_t>(sizeof(record));
+            if (!ok && written >= 0) {
+                errno = ENOSPC;  // a short write sets no errno; on a regular file the disk is full
+            }
+        }
+        // Keep the cause of a failure for the caller; close() may overwrite errno
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return ok;
+    }
+
+    std::string path_;
+    std::string tag_;
+    mutable std::mutex mutex_;
+    UsageTotals totals_;
+};
+
+// Global usage ledger, null when usage recording is disabled
+std::unique_ptr<UsageLedger> gLedger;
+
+/**
+ * @brief Token and cost limits for a cmdgpt run, and what has been spent so far.
+ *
+ * Before each request the estimated prompt cost is checked against the remaining budget,
+ * and the completion is capped with max_tokens so that it cannot overrun it. After each
+ * request the actual usage reported by the server is charged.
+ */
+struct UsageBudget {
+    uint64_t max_tokens_total = 0;     // 0 means unlimited
+    uint64_t max_cost_micro_usd = 0;   // 0 means unlimited
+    uint64_t used_tokens = 0;
+    uint64_t used_cost_micro_usd = 0;
+    uint64_t requests = 0;
+};
+
+// Global budget of the current run
+UsageBudget gBudget;
+
+/**
+ * @brief Checks a request against the remaining budget and computes its completion limit.
+ * @param model The model the request will be sent to.
+ * @param estimated_prompt_tokens The locally estimated prompt size.
+ * @param max_tokens A reference that receives the completion token limit, 0 for no limit.
+ * @return True if the request may be sent, false if it would exceed the budget.
+ */
+bool check_budget(std::string_view model, uint64_t estimated_prompt_tokens, uint64_t& max_tokens) {
+    max_tokens = 0;
+    if (gBudget.max_tokens_total > 0) {
+        const uint64_t remaining = gBudget.max_tokens_total > gBudget.used_tokens ? gBudget.max_tokens_total - gBudget.used_tokens : 0;
+        if (estimated_prompt_tokens >= remaining) {
+            gLogger->error("Error: The prompt (~{} tokens) does not fit in the remaining token budget of {} tokens.",
+                           estimated_prompt_tokens, remaining);
+            return false;
+        }
+        max_tokens = remaining - estimated_prompt_tokens;
+    }
+    if (gBudget.max_cost_micro_usd > 0) {
+        const ModelPrice* price = find_model_price(model);
+        if (!price) {
+            // Without a price every request would look free, so the cap could not stop any of them
+            gLogger->error("Error: No price known for model {}; the cost budget cannot be enforced.", model);
+            return false;
+        }
+        const uint64_t remaining = gBudget.max_cost_micro_usd > gBudget.used_cost_micro_usd ? gBudget.max_cost_micro_usd - gBudget.used_cost_micro_usd : 0;
+        const uint64_t prompt_cost = estimate_cost_micro_usd(model, estimated_prompt_tokens, 0, 0);
+        // Project the cost of this request from the average of the ones before it, if any
+        const uint64_t projected_cost = gBudget.requests > 0 ? gBudget.used_cost_micro_usd / gBudget.requests : prompt_cost;
+        if (prompt_cost >= remaining || projected_cost > remaining) {
+            gLogger->error("Error: The request (~${:.4f}) does not fit in the remaining cost budget of ${:.4f}.",
+                           std::max(prompt_cost, projected_cost) / 1e6, remaining / 1e6);
+            return false;
+        }
+        const auto affordable_tokens = static_cast<uint64_t>((remaining - prompt_cost) / price->output);
+        if (affordable_tokens == 0) {
+            gLogger->error("Error: The remaining cost budget of ${:.4f} does not cover any completion tokens.", remaining / 1e6);
+            return false;
+        }
+        if (max_tokens == 0 || affordable_tokens < max_tokens) {
+            max_tokens = affordable_tokens;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Charges the usage block of a chat completion response to the budget and
+ *        records it in the usage ledger, if enabled.
+ * @param res_json The parsed response.
+ * @param requested_model The model that was requested, used if the response does not name one.
+ * @param latency The time from sending the request to receiving the response.
+ */
+void account_usage(const json& res_json, const std::string& requested_model, std::chrono::milliseconds latency) {
+    const json& usage = res_json[USAGE_KEY];
+    if (!usage.is_object()) {
+        gLogger->warn("Warning: Ignoring a malformed usage block: {}", usage.dump());
+        return;
+    }
+    // A count that is missing or not a number is taken as 0 rather than aborting the run
+    const auto count = [](const json& object, std::string_view key) -> uint64_t {
+        const auto it = object.find(key);
+        return it != object.end() && it->is_number_unsigned() ? it->get<uint64_t>() : 0;
+    };
+    const uint64_t prompt_tokens = count(usage, PROMPT_TOKENS_KEY);
+    const uint64_t completion_tokens = count(usage, COMPLETION_TOKENS_KEY);
+    uint64_t cached_tokens = 0;
+    if (usage.contains(PROMPT_TOKENS_DETAILS_KEY) && usage[PROMPT_TOKENS_DETAILS_KEY].is_object()) {
+        cached_tokens = count(usage[PROMPT_TOKENS_DETAILS_KEY], CACHED_TOKENS_KEY);
+    }
+    const auto model_it = res_json.find(MODEL_KEY);
+    const std::string model = model_it != res_json.end() && model_it->is_string() ? model_it->get<std::string>() : requested_model;
+    gBudget.used_tokens += prompt_tokens + completion_tokens;
+    gBudget.used_cost_micro_usd += estimate_cost_micro_usd(model, prompt_tokens, cached_tokens, completion_tokens);
+    ++gBudget.requests;
+    if (gLedger && !gLedger->record(model, prompt_tokens, completion_tokens, cached_tokens, latency)) {
+        const int error = errno;
+        gLogger->warn("Warning: Could not write to the usage ledger: {}", std::strerror(error));
+    }
+    gLogger->debug("Debug: Usage: {} prompt ({} cached), {} completion tokens in {} ms",
+                   prompt_tokens, cached_tokens, completion_tokens, latency.count());
+}
+
+/**
+ * @brief Incremental parser for a server-sent events stream.
+ *
+ * Chunks are scanned in place for line ends with memchr, which the C library vectorizes.
+ * When an event lies within one chunk its data is handed to the caller as a view into
+ * the chunk; only a line split across chunks, or event data still incomplete at the end
+ * of a chunk, is copied. Several data lines of one event are joined with '\n'. Other
+ * fields and comments are ignored.
+ */
+class SseParser {
+public:
+    /**
+     * @brief Parses the next chunk of the stream.
+     * @param chunk The bytes received. They need not end on a line or event boundary.
+     * @param on_event Called with the data of each complete event. The view is only valid
+     *                 during the call.
+     */
+    template <typename Handler>
+    void feed(std::string_view chunk, Handler&& on_event) {
+        if (!partial_line_.empty()) {
+            const void* newline = std::memchr(chunk.data(), '\n', chunk.size());
+            if (!newline) {
+                partial_line_.append(chunk.data(), chunk.size());
+                return;
+            }
+            const size_t length = static_cast<const char*>(newline) - chunk.data();
+            partial_line_.append(chunk.data(), length);
+            process_line(partial_line_, on_event);
+            own_data();
+            partial_line_.clear();
+            chunk.remove_prefix(length + 1);
+        }
+        while (!chunk.empty()) {
+            const void* newline = std::memchr(chunk.data(), '\n', chunk.size());
+            if (!newline) {
+                partial_line_.assign(chunk.data(), chunk.size());
+                break;
+            }
+            const size_t length = static_cast<const char*>(newline) - chunk.data();
+            process_line(chunk.substr(0, length), on_event);
+            chunk.remove_prefix(length + 1);
+        }
+        // The chunk is gone after this call, so pending event data must be copied
+        own_data();
+    }
+
+private:
+    template <typename Handler>
+    void process_line(std::string_view line, Handler& on_event) {
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            // A blank line ends the event
+            if (has_data_) {
+                on_event(owned_ ? std::string_view(data_) : data_view_);
+            }
+            has_data_ = false;
+            owned_ = false;
+            data_.clear();
+            return;
+        }
+        if (line.compare(0, 5, "data:") != 0) {
+            return;
+        }
+        line.remove_prefix(5);
+        if (!line.empty() && line.front() == ' ') {
+            line.remove_prefix(1);
+        }
+        if (!has_data_) {
+            data_view_ = line;
+            has_data_ = true;
+            return;
+        }
+        own_data();
+        data_ += '\n';
+        data_.append(line.data(), line.size());
+    }
+
+    void own_data() {
+        if (has_data_ && !owned_) {
+            data_.assign(data_view_.data(), data_view_.size());
+            owned_ = true;
+        }
+    }
+
+    std::string partial_line_;
+    std::string data_;
+    std::string_view data_view_;
+    bool has_data_ = false;
+    bool owned_ = false;
+};
+
+/**
+ * @brief Decodes the body of a JSON string literal.
+ * @param text The JSON text.
+ * @param pos The position after the opening quote; advanced past the closing quote.
+ * @param out The string the decoded characters are appended to.
+ * @return False if the literal is malformed or not terminated.
+ */
+bool decode_json_string(std::string_view text, size_t& pos, std::string& out) {
+    while (pos < text.size()) {
+        // Copy the run up to the next quote or escape in one go
+        size_t end = pos;
+        while (end < text.size() && text[end] != '"' && text[end] != '\\') {
+            ++end;
+        }
+        out.append(text.data() + pos, end - pos);
+        if (end >= text.size()) {
+            return false;
+        }
+        if (text[end] == '"') {
+            pos = end + 1;
+            return true;
+        }
+        if (end + 1 >= text.size()) {
+            return false;
+        }
+        pos = end + 2;
+        switch (text[end + 1]) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                auto read_hex4 = [&](uint32_t& value) {
+                    if (pos + 4 > text.size()) {
+                        return false;
+                    }
+                    value = 0;
+                    for (size_t i = 0; i < 4; ++i) {
+                        const char c = text[pos++];
+                        value <<= 4;
+                        if (c >= '0' && c <= '9') {
+                            value |= c - '0';
+                        } else if (c >= 'a' && c <= 'f') {
+                            value |= c - 'a' + 10;
+                        } else if (c >= 'A' && c <= 'F') {
+                            value |= c - 'A' + 10;
+                        } else {
+                            return false;
+                        }
+                    }
+                    return true;
+                };
+                uint32_t code_point;
+                if (!read_hex4(code_point)) {
+                    return false;
+                }
+                if (code_point >= 0xd800 && code_point < 0xdc00) {
+                    // A high surrogate must be followed by an escaped low surrogate
+                    uint32_t low;
+                    if (text.compare(pos, 2, "\\u") != 0) {
+                        return false;
+                    }
+                    pos += 2;
+                    if (!read_hex4(low) || low < 0xdc00 || low >= 0xe000) {
+                        return false;
+                    }
+                    code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+                } else if (code_point >= 0xdc00 && code_point < 0xe000) {
+                    return false;
+                }
+                if (code_point < 0x80) {
+                    out += static_cast<char>(code_point);
+                } else if (code_point < 0x800) {
+                    out += static_cast<char>(0xc0 | (code_point >> 6));
+                    out += static_cast<char>(0x80 | (code_point & 0x3f));
+                } else if (code_point < 0x10000) {
+                    out += static_cast<char>(0xe0 | (code_point >> 12));
+                    out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+                    out += static_cast<char>(0x80 | (code_point & 0x3f));
+                } else {
+                    out += static_cast<char>(0xf0 | (code_point >> 18));
+                    out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+                    out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+                    out += static_cast<char>(0x80 | (code_point & 0x3f));
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief What one streamed chat completion chunk carries.
+ */
+struct StreamDelta {
+    std::string content;        // text to append to the response
+    std::string finish_reason;  // empty until the last choice chunk
+    json usage_chunk;           // the chunk carrying the usage block, if this is it
+};
+
+/**
+ * @brief Extracts the content of an ordinary streamed chunk without building a JSON DOM.
+ *
+ * Handles the common case, a chunk whose delta carries a string content and whose
+ * finish_reason is null. Anything else is left to the full JSON parser.
+ * @param data The event data.
+ * @param content The string the delta content is appended to.
+ * @return True if the chunk was handled, false if it needs the full parser.
+ */
+bool parse_stream_delta_fast(std::string_view data, std::string& content) {
+    const size_t delta = data.find(STREAM_DELTA_PATTERN);
+    if (delta == std::string_view::npos) {
+        return false;
+    }
+    const size_t fields = delta + STREAM_DELTA_PATTERN.size();
+    const size_t key = data.find(STREAM_CONTENT_PATTERN, fields);
+    // The key must be a field of the delta itself, not of a later object such as logprobs
+    if (key == std::string_view::npos || data.substr(fields, key - fields).find_first_of("{}") != std::string_view::npos) {
+        return false;
+    }
+    size_t pos = key + STREAM_CONTENT_PATTERN.size();
+    if (pos >= data.size() || data[pos] != '"') {
+        return false;
+    }
+    ++pos;
+    const size_t content_size = content.size();
+    if (!decode_json_string(data, pos, content) ||
+        data.find(STREAM_OPEN_FINISH_PATTERN, pos) == std::string_view::npos) {
+        content.resize(content_size);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses the data of one streamed chat completion event.
+ * @param data The event data, a chat.completion.chunk JSON object.
+ * @param delta The delta the content, finish reason and usage are stored in.
+ */
+void parse_stream_delta(std::string_view data, StreamDelta& delta) {
+    if (parse_stream_delta_fast(data, delta.content)) {
+        return;
+    }
+    json chunk;
+    try {
+        chunk = json::parse(data);
+    } catch (const json::parse_error& e) {
+        gLogger->warn("Warning: Ignoring malformed stream event: {}", e.what());
+        return;
+    }
+    if (chunk.contains(ERROR_KEY)) {
+        gLogger->error("Error: The server reported an error in the stream: {}", chunk[ERROR_KEY].dump());
+        return;
+    }
+    if (chunk.contains(CHOICES_KEY) && chunk[CHOICES_KEY].is_array() && !chunk[CHOICES_KEY].empty()) {
+        const json& choice = chunk[CHOICES_KEY][0];
+        if (choice.contains(DELTA_KEY) && choice[DELTA_KEY].contains(CONTENT_KEY) && choice[DELTA_KEY][CONTENT_KEY].is_string()) {
+            delta.content += choice[DELTA_KEY][CONTENT_KEY].get_ref<const std::string&>();
+        }
+        if (choice.contains(FINISH_REASON_KEY) && choice[FINISH_REASON_KEY].is_string()) {
+            delta.finish_reason = choice[FINISH_REASON_KEY].get<std::string>();
+        }
+    }
+    if (chunk.contains(USAGE_KEY) && chunk[USAGE_KEY].is_object()) {
+        delta.usage_chunk = std::move(chunk);
+    }
+}
+
+/**
+ * @brief Sends a streaming chat completion request and consumes the event stream.
+ * @param cli The HTTP client to send with.
+ * @param api_key The API key to authorize the request with.
+ * @param data The request body, with "stream" set.
+ * @param response A reference to a string the streamed content is appended to.
+ * @param stream A reference to a StreamDelta that receives the finish reason and usage chunk.
+ * @param error_body A reference to a string that receives the body of a non-200 response.
+ * @param utf8_carry A reference to a string that receives the bytes of a UTF-8 character the
+ *                   stream ended inside of. They are not emitted; the caller decides whether
+ *                   a continuation regenerates the character or the bytes are repaired.
+ * @param on_delta Called with each piece of content as it arrives.
+ * @return The HTTP result. Its body is empty; the content went to response.
+ */
+httplib::Result post_streaming_request(httplib::Client& cli, const std::string& api_key, const std::string& data,
+                                       std::string& response, StreamDelta& stream, std::string& error_body,
+                                       std::string& utf8_carry, const DeltaHandler& on_delta) {
+    httplib::Request req;
+    req.method = "POST";
+    req.path = std::string(URL);
+    // Set explicitly: whether send() adds the client's default headers depends on the library version
+    req.headers = {{std::string(CONTENT_TYPE_HEADER), std::string(APPLICATION_JSON)},
+                   {std::string(AUTHORIZATION_HEADER), bearer_authorization(api_key)}};
+    req.body = data;
+
+    int status = 0;
+    bool done = false;
+    SseParser parser;
+    StreamDelta delta;
+    utf8_carry.clear();
+    req.response_handler = [&](const httplib::Response& res) {
+        status = res.status;
+        return true;
+    };
+    req.content_receiver = [&](const char* buffer, size_t length, uint64_t, uint64_t) {
+        if (status != HTTP_OK) {
+            error_body.append(buffer, length);
+            return true;
+        }
+        parser.feed(std::string_view(buffer, length), [&](std::string_view event) {
+            if (event == STREAM_DONE_EVENT) {
+                done = true;
+                return;
+            }
+            delta.content = std::move(utf8_carry);
+            utf8_carry.clear();
+            parse_stream_delta(event, delta);
+            // Hold back a character cut off at the end of the delta until the next one completes it
+            const size_t complete = utf8_complete_prefix(delta.content);
+            if (complete < delta.content.size()) {
+                utf8_carry.assign(delta.content, complete);
+                delta.content.resize(complete);
+            }
+            if (!delta.content.empty()) {
+                response += delta.content;
+                on_delta(delta.content);
+            }
+            if (!delta.finish_reason.empty()) {
+                stream.finish_reason = delta.finish_reason;
+            }
+            if (!delta.usage_chunk.is_null()) {
+                stream.usage_chunk = std::move(delta.usage_chunk);
+                delta.usage_chunk = nullptr;
+            }
+        });
+        return true;
+    };
+
+    auto res = cli.send(req);
+    if (res && res->status == HTTP_OK && !done) {
+        gLogger->warn("Warning: The stream ended before the server sent [DONE].");
+    }
+    return res;
+}
+
+/**
+ * @brief Batches streamed output into few large writes while bounding the delay it adds.
+ *
+ * Pieces are buffered and written when the buffer is full, when the oldest buffered byte
+ * has waited max_latency, or, if the output is a terminal, as soon as a newline arrives.
+ * A background thread enforces the latency bound when no further pieces arrive.
+ */
+class OutputCoalescer {
+public:
+    /**
+     * @param fd The file descriptor to write to.
+     * @param max_latency The longest time a byte may stay buffered; zero writes every piece at once.
+     */
+    OutputCoalescer(int fd, std::chrono::milliseconds max_latency)
+        : fd_(fd), max_latency_(max_latency), is_tty_(isatty(fd) == 1) {
+        buffer_.reserve(OUTPUT_BUFFER_SIZE);
+        if (max_latency_.count() > 0) {
+            flusher_ = std::thread([this] { run_flusher(); });
+        }
+    }
+
+    ~OutputCoalescer() {
+        finish();
+    }
+
+    /**
+     * @brief Queues a piece of output.
+     */
+    void write(std::string_view data) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const bool was_empty = buffer_.empty();
+        buffer_.append(data.data(), data.size());
+        if (was_empty) {
+            first_pending_ = std::chrono::steady_clock::now();
+            wakeup_.notify_one();
+        }
+        if (max_latency_.count() == 0 || buffer_.size() >= OUTPUT_BUFFER_SIZE ||
+            (is_tty_ && data.find('\n') != std::string_view::npos)) {
+            flush_locked();
+        }
+    }
+
+    /**
+     * @brief Writes out everything buffered and stops the background thread.
+     */
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            flush_locked();
+            stopping_ = true;
+            wakeup_.notify_one();
+        }
+        if (flusher_.joinable()) {
+            flusher_.join();
+        }
+    }
+
+    /**
+     * @return The number of bytes written so far.
+     */
+    uint64_t bytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+
+    /**
+     * @return The number of write() calls made so far.
+     */
+    uint64_t writes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return writes_;
+    }
+
+    /**
+     * @return The longest time a byte stayed buffered before it was written.
+     */
+    std::chrono::microseconds max_delay() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_delay_;
+    }
+
+private:
+    void run_flusher() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            if (buffer_.empty()) {
+                wakeup_.wait(lock);
+                continue;
+            }
+            const auto deadline = first_pending_ + max_latency_;
+            wakeup_.wait_until(lock, deadline);
+            if (!buffer_.empty() && std::chrono::steady_clock::now() >= first_pending_ + max_latency_) {
+                flush_locked();
+            }
+        }
+    }
+
+    void flush_locked() {
+        if (buffer_.empty()) {
+            return;
+        }
+        const auto delay = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - first_pending_);
+        if (delay > max_delay_) {
+            max_delay_ = delay;
+        }
+        size_t written = 0;
+        while (written < buffer_.size()) {
+            const ssize_t n = ::write(fd_, buffer_.data() + written, buffer_.size() - written);
+            ++writes_;
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            written += static_cast<size_t>(n);
+        }
+        bytes_ += written;
+        buffer_.clear();
+    }
+
+    const int fd_;
+    const std::chrono::milliseconds max_latency_;
+    const bool is_tty_;
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::thread flusher_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point first_pending_;
+    bool stopping_ = false;
+    uint64_t bytes_ = 0;
+    uint64_t writes_ = 0;
+    std::chrono::microseconds max_delay_{0};
+};
+
+/**
+ * @brief Tells whether a streamed request failed in a way that is worth continuing from.
+ * @param res The HTTP result of the request.
+ * @param stream The finish reason of the stream, empty if it was not received.
+ * @return True for a lost connection, a 5xx server error, or a stream cut off before it finished.
+ */
+bool is_retryable_stream_failure(const httplib::Result& res, const StreamDelta& stream) {
+    if (!res) {
+        return true;
+    }
+    switch (res->status) {
+        case HTTP_OK:
+            return stream.finish_reason.empty();
+        case HTTP_INTERNAL_SERVER_ERROR:
+        case HTTP_BAD_GATEWAY:
+        case HTTP_SERVICE_UNAVAILABLE:
+        case HTTP_GATEWAY_TIMEOUT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Sends a message to the GPT Chat API and returns the HTTP response status code.
+ * @param prompt The text prompt to send to the API.
+ * @param response A reference to a string where the API response will be stored.
+ * @param api_keys The pool of API keys for the OpenAI GPT API. A request that gets a 429
+ *                 is retried once with each other key that is not rate limited.
+ * @param system_prompt The system prompt for the OpenAI GPT API. Default is an empty string.
+ * @param model The GPT model to use. Default is DEFAULT_MODEL.
+ * @param server_url The base URL of the API server. Default is SERVER_URL.
+ * @param on_delta If set, the response is streamed and each piece is passed to on_delta as it
+ *                 arrives, in addition to being collected in response. If the stream fails
+ *                 part-way, the received part is kept and a continuation is requested, up to
+ *                 MAX_STREAM_CONTINUATIONS times. Default is no streaming.
+ * @param temperature The sampling temperature, or a negative value to leave it to the server.
+ * @param finish_reason_out If set, receives the finish reason of the response, e.g. "stop".
+ * @return The HTTP response status code, EMPTY_RESPONSE_CODE if no response was received,
+ *         or BUDGET_EXCEEDED_CODE if the request was not sent because it would exceed the budget.
+ * @throws std::invalid_argument If no API key or system prompt was provided.
+ */
+int get_gpt_chat_response(const std::string& prompt, std::string& response, ApiKeyPool& api_keys, const std::string& system_prompt = "", const std::string& model = DEFAULT_MODEL, const std::string& server_url = SERVER_URL, const DeltaHandler& on_delta = nullptr,
+                          double temperature = SERVER_DEFAULT_TEMPERATURE, std::string* finish_reason_out = nullptr) {
+    // Declare the required variables at the beginning of the function
+    json res_json;
+    std::string finish_reason;
+    StreamDelta stream;
+    std::string stream_error_body;
+    std::string utf8_carry;
+
+    // API key and system prompt must be provided
+    if (api_keys.size() == 0 || system_prompt.empty()) {
+        throw std::invalid_argument("API key and system prompt must be provided.");
+    }
+
+    const auto request_start = std::chrono::steady_clock::now();
+    httplib::Result res;
+    uint64_t max_tokens = 0;
+    for (int continuation = 0;; ++continuation) {
+        // Check the budget and cap the completion so it cannot overrun it
+        const uint64_t estimated_tokens = response.empty()
+            ? estimate_prompt_tokens({system_prompt, prompt})
+            : estimate_prompt_tokens({system_prompt, prompt, response, CONTINUATION_PROMPT});
+        if (!check_budget(model, estimated_tokens, max_tokens)) {
+            return BUDGET_EXCEEDED_CODE;
+        }
+
+        // Prepare the JSON data for the POST request; a continuation carries the partial answer
+        const std::string data = build_chat_request_body(model, system_prompt, prompt, max_tokens, static_cast<bool>(on_delta), response, temperature);
+
+        // Log the data being sent
+        gLogger->debug("Debug: Sending POST request to {} with {} bytes of data", URL, data.size());
+        gLogger->trace("Trace: Request data: {}", data);
+
+        // Send the POST request with the key that has the most headroom
+        for (size_t attempt = 0; attempt < api_keys.size(); ++attempt) {
+            std::string api_key;
+            const int key_index = api_keys.acquire(api_key);
+            if (key_index < 0) {
+                gLogger->error("Error: All API keys are rate limited.");
+                return HTTP_TOO_MANY_REQUESTS;
+            }
+            gLogger->debug("Debug: Using API key #{}", key_index + 1);
+
+            // Get the HTTP client, which carries the authorization header
+            httplib::Client& cli = get_api_client(server_url, api_key);
+            if (on_delta) {
+                stream = StreamDelta();
+                stream_error_body.clear();
+                const auto attempt_start = std::chrono::steady_clock::now();
+                res = post_streaming_request(cli, api_key, data, response, stream, stream_error_body, utf8_carry, on_delta);
+                // Every attempt is billed, so its usage is charged now rather than only the last one's
+                if (stream.usage_chunk.contains(USAGE_KEY)) {
+                    account_usage(stream.usage_chunk, model, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                                 std::chrono::steady_clock::now() - attempt_start));
+                }
+            } else {
+                res = cli.Post(std::string(URL), data, std::string(APPLICATION_JSON));
+            }
+            if (!res) {
+                break;
+            }
+            api_keys.update(key_index, *res);
+            if (res->status != HTTP_TOO_MANY_REQUESTS) {
+                break;
+            }
+            gLogger->warn("Warning: API key #{} is rate limited.", key_index + 1);
+        }
+
+        // Only streams are continued, since only they leave a usable partial answer behind
+        if (!on_delta || continuation >= MAX_STREAM_CONTINUATIONS || !is_retryable_stream_failure(res, stream)) {
+            break;
+        }
+        gLogger->warn("Warning: The stream failed ({}) after {} bytes; continuing ({} of {}).",
+                      res ? "HTTP " + std::to_string(res->status) : httplib::to_string(res.error()),
+                      response.size(), continuation + 1, MAX_STREAM_CONTINUATIONS);
+        // The continuation regenerates a character the stream was cut off inside of
+        utf8_carry.clear();
+        std::this_thread::sleep_for(CONTINUATION_BACKOFF * (continuation + 1));
+    }
+    const auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - request_start);
+
+    // No continuation follows, so a character the stream ended inside of can only be repaired
+    if (!utf8_carry.empty()) {
+        gLogger->warn("Warning: The stream ended inside a UTF-8 character.");
+        repair_utf8(utf8_carry);
+        response += utf8_carry;
+        on_delta(utf8_carry);
+    }
+
+    // A streamed error response is collected separately; log it like any other body
+    if (res && on_delta && res->status != HTTP_OK) {
+        res->body = std::move(stream_error_body);
+    }
+
+    // If response is received from the server
+    if (res) {
+        gLogger->debug("Debug: Received HTTP response with status {} and {} bytes of body", res->status, res->body.size());
+        gLogger->trace("Trace: Response body: {}", res->body);
+        // Handle the HTTP response status code
+        switch (res->status) {
+            case HTTP_OK:
+                // Everything is fine
+                break;
+            case HTTP_BAD_REQUEST:
+                gLogger->error("Error: Bad request.");
+                return res->status;
+            case HTTP_UNAUTHORIZED:
+                gLogger->error("Error: Unauthorized. Check your API key.");
+                return res->status;
+            case HTTP_FORBIDDEN:
+                gLogger->error("Error: Forbidden. You do not have the necessary permissions.");
+                return res->status;
+            case HTTP_NOT_FOUND:
+                gLogger->error("Error: Not Found. The requested URL was not found on the server.");
+                return res->status;
+            case HTTP_TOO_MANY_REQUESTS:
+                gLogger->error("Error: Too many requests. All API keys are rate limited.");
+                return res->status;
+            case HTTP_INTERNAL_SERVER_ERROR:
+                gLogger->error("Error: Internal Server Error. The server encountered an unexpected condition.");
+                return res->status;
+            default:
+                gLogger->error("Error: Received unexpected HTTP status code: {}", res->status);
+                return res->status;
+        }
+    } else {
+        gLogger->debug("Debug: No response received from the server.");
+        return EMPTY_RESPONSE_CODE;
+    }
+
+    if (on_delta) {
+        // The content was streamed into response already, and each attempt's usage was charged
+        finish_reason = stream.finish_reason;
+    } else if (!res->body.empty()) {
+        // Parse the JSON response
+        res_json = json::parse(res->body);
+
+        // If 'choices' array is empty
+        if (res_json[CHOICES_KEY].empty()) {
+            gLogger->error("Error: '{}' array is empty.", CHOICES_KEY);
+            return EMPTY_RESPONSE_CODE;
+        }
+        // If 'finish_reason' field is missing
+        if (!res_json[CHOICES_KEY][0].contains(FINISH_REASON_KEY)) {
+            gLogger->error("Error: '{}' field is missing.", FINISH_REASON_KEY);
+            return EMPTY_RESPONSE_CODE;
+        }
+        // If 'content' field is missing
+        if (!res_json[CHOICES_KEY][0][MESSAGE_KEY].contains(CONTENT_KEY)) {
+            gLogger->error("Error: '{}' field is missing.", CONTENT_KEY);
+            return EMPTY_RESPONSE_CODE;
+        }
+
+        // Extract 'finish_reason' and 'content'
+        finish_reason = res_json[CHOICES_KEY][0][FINISH_REASON_KEY].get<std::string>();
+        response = res_json[CHOICES_KEY][0][MESSAGE_KEY][CONTENT_KEY].get<std::string>();
+    }
+
+    gLogger->debug("Finish reason: {}", finish_reason);
+    if (finish_reason_out) {
+        *finish_reason_out = finish_reason;
+    }
+    if (max_tokens > 0 && finish_reason == "length") {
+        gLogger->warn("Warning: The response was cut off at {} tokens to stay within the budget.", max_tokens);
+    }
+
+    // Account for the token usage, if the server reported it
+    if (res_json.contains(USAGE_KEY)) {
+        account_usage(res_json, model, latency);
+    }
+
+    return res->status;
+}
+
+/**
+ * @brief Returns how many slices to split work over, one per core but not tiny ones.
+ * @param count The number of items.
+ * @param min_per_slice The number of items below which a slice is not worth a thread.
+ */
+size_t parallel_slice_count(size_t count, size_t min_per_slice) {
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::min(max_threads, std::max<size_t>(1, count / min_per_slice));
+}
+
+/**
+ * @brief Splits [0, count) into slice_count contiguous slices and processes them in parallel.
+ * @param work Called as work(slice, begin, end) once per slice; the first slice runs on the
+ *             calling thread.
+ */
+template <typename Work>
+void parallel_for_slices(size_t count, size_t slice_count, Work work) {
+    const size_t chunk = (count + slice_count - 1) / slice_count;
+    auto run_slice = [&](size_t slice) {
+        const size_t begin = std::min(count, slice * chunk);
+        work(slice, begin, std::min(count, begin + chunk));
+    };
+    std::vector<std::thread> threads;
+    for (size_t slice = 1; slice < slice_count; ++slice) {
+        threads.emplace_back(run_slice, slice);
+    }
+    run_slice(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Response cache layout: an index file of a CacheIndexHeader followed by fixed-size
+// CacheIndexEntries, and a data file of CacheRecords that the entries point into.
+// Both are append-only; writers hold an exclusive flock() on the index while appending.
+constexpr char CACHE_INDEX_MAGIC[8] = {'C', 'G', 'P', 'T', 'C', 'I', 'D', 'X'};
+constexpr uint32_t CACHE_VERSION = 1;
+constexpr char CACHE_INDEX_FILE[] = "/index";
+constexpr char CACHE_DATA_FILE[] = "/data";
+constexpr uint32_t CACHE_ENTRY_DETERMINISTIC = 1;   // The answer was generated at temperature 0
+constexpr uint32_t CACHE_ENTRY_ZSTD = 2;            // The answer is stored as a zstd frame
+// New answers are compressed with the dictionary in CACHE_DICT_FILE. Every dictionary is also
+// kept as CACHE_DICT_FILE-<id>, so that answers compressed with an older one stay readable.
+constexpr char CACHE_DICT_FILE[] = "/dict";
+constexpr int CACHE_COMPRESSION_LEVEL = 3;
+constexpr size_t DEFAULT_CACHE_DICT_SIZE = 112 * 1024;
+
+// Fields of the JSONL lines of `cmdgpt cache import` and `cmdgpt cache export`, besides MODEL_KEY
+constexpr std::string_view SYSTEM_PROMPT_KEY = "system_prompt";
+constexpr std::string_view PROMPT_KEY = "prompt";
+constexpr std::string_view RESPONSE_KEY = "response";
+constexpr std::string_view TEMPERATURE_KEY = "temperature";
+
+struct CacheIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+};
+
+struct CacheIndexEntry {
+    uint64_t key_hash;       // Hash of model, system prompt and prompt
+    uint64_t context_hash;   // Hash of model and system prompt; fuzzy hits must match it
+    uint64_t simhash;        // SimHash of the normalized prompt
+    uint64_t offset;         // Offset of the CacheRecord in the data file
+    uint32_t size;           // Size of the CacheRecord including its header
+    uint32_t flags;
+};
+static_assert(sizeof(CacheIndexHeader) == 16, "cache index header layout must not change");
+static_assert(sizeof(CacheIndexEntry) == 40, "cache index entry layout must not change");
+
+// A CacheRecord is this header followed by the model, system prompt, prompt and response
+struct CacheRecordHeader {
+    uint32_t model_size;
+    uint32_t system_prompt_size;
+    uint32_t prompt_size;
+    uint32_t response_size;
+};
+
+#ifdef CMDGPT_WITH_ZSTD
+/**
+ * @brief Returns the calling thread's zstd compression context, creating it on first use.
+ *
+ * A context holds several hundred KiB of tables, too much to set up for every small answer.
+ */
+ZSTD_CCtx* thread_compression_context() {
+    thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    return cctx.get();
+}
+
+/**
+ * @brief Returns the calling thread's zstd decompression context, creating it on first use.
+ */
+ZSTD_DCtx* thread_decompression_context() {
+    thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    return dctx.get();
+}
+#endif
+
+/**
+ * @brief The fields of a CacheRecord, as views into the record.
+ */
+struct CacheRecordView {
+    std::string_view model;
+    std::string_view system_prompt;
+    std::string_view prompt;
+    std::string_view response;   // Compressed if the entry has CACHE_ENTRY_ZSTD
+};
+
+/**
+ * @brief Splits a CacheRecord into its fields.
+ * @param data The record, header included.
+ * @param view A reference that receives the fields.
+ * @return False if the record is malformed.
+ */
+bool parse_cache_record(std::string_view data, CacheRecordView& view) {
+    CacheRecordHeader record;
+    if (data.size() < sizeof(record)) {
+        return false;
+    }
+    std::memcpy(&record, data.data(), sizeof(record));
+    if (sizeof(record) + uint64_t{record.model_size} + record.system_prompt_size + record.prompt_size + record.response_size != data.size()) {
+        return false;
+    }
+    data.remove_prefix(sizeof(record));
+    view.model = data.substr(0, record.model_size);
+    data.remove_prefix(record.model_size);
+    view.system_prompt = data.substr(0, record.system_prompt_size);
+    data.remove_prefix(record.system_prompt_size);
+    view.prompt = data.substr(0, record.prompt_size);
+    view.response = data.substr(record.prompt_size);
+    return true;
+}
+
+/**
+ * @brief Maps a whole file read-only.
+ * @param path The file.
+ * @param size A reference that receives the size of the mapping.
+ * @return The mapping, to be released with munmap(), or null if the file is missing, empty
+ *         or cannot be mapped.
+ */
+const char* map_file(const std::string& path, size_t& size) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = static_cast<size_t>(st.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return mapping == MAP_FAILED ? nullptr : static_cast<const char*>(mapping);
+}
+
+/**
+ * @brief Hashes bytes with 64-bit FNV-1a.
+ * @param data The bytes to hash.
+ * @param hash The hash to continue from, so that several strings can be hashed as one.
+ * @return The hash.
+ */
+uint64_t fnv1a_hash(std::string_view data, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (const char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hashes the model and system prompt, which a cached answer must match exactly.
+ */
+uint64_t cache_context_hash(std::string_view model, std::string_view system_prompt) {
+    return fnv1a_hash(system_prompt, fnv1a_hash(std::string_view("\0", 1), fnv1a_hash(model)));
+}
+
+/**
+ * @brief Hashes a whole request for exact cache lookups.
+ */
+uint64_t cache_key_hash(std::string_view model, std::string_view system_prompt, std::string_view prompt) {
+    return fnv1a_hash(prompt, fnv1a_hash(std::string_view("\0", 1), cache_context_hash(model, system_prompt)));
+}
+
+/**
+ * @brief Joins model, system prompt and prompt into the exact key of a request.
+ */
+std::string cache_request_key(std::string_view model, std::string_view system_prompt, std::string_view prompt) {
+    std::string key;
+    key.reserve(model.size() + system_prompt.size() + prompt.size() + 2);
+    key.append(model).append(1, '\0').append(system_prompt).append(1, '\0').append(prompt);
+    return key;
+}
+
+/**
+ * @brief Scrambles the bits of a 64-bit hash (the splitmix64 finalizer).
+ */
+uint64_t mix_hash(uint64_t hash) {
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * @brief Counts the ASCII digits at a position of a text.
+ */
+size_t count_digits(std::string_view text, size_t pos) {
+    size_t count = 0;
+    while (pos + count < text.size() && text[pos + count] >= '0' && text[pos + count] <= '9') {
+        ++count;
+    }
+    return count;
+}
+
+/**
+ * @brief Measures a date or time of day starting at a position of a text.
+ *
+ * Recognizes YYYY-MM-DD and YYYY/MM/DD dates, D/M/YYYY and D.M.YYYY dates with a four-digit
+ * year, H:MM:SS and H:MM:SS.fff times, and a date followed by 'T' or a space and a time, in
+ * which the seconds may be left out, optionally with a trailing 'Z', as in ISO 8601
+ * timestamps. Shorter forms are left alone: "2.0.10" is a version and "3:16" a verse or
+ * a score as often as a date or a time.
+ * @param text The text.
+ * @param pos The position of the first digit.
+ * @return The length of the date or time, or 0 if there is none at pos.
+ */
+size_t timestamp_length(std::string_view text, size_t pos) {
+    // Returns the length of a separator followed by min to max digits at a position, or 0
+    auto field = [text](size_t at, char separator, size_t min_digits, size_t max_digits) -> size_t {
+        if (at >= text.size() || text[at] != separator) {
+            return 0;
+        }
+        const size_t digits = count_digits(text, at + 1);
+        return digits >= min_digits && digits <= max_digits ? digits + 1 : 0;
+    };
+
+    const size_t lead = count_digits(text, pos);
+    size_t date = 0;
+    for (const char separator : {'-', '/', '.'}) {
+        const bool year_first = lead == 4 && separator != '.';
+        const bool year_last = (lead == 1 || lead == 2) && separator != '-';
+        if (!year_first && !year_last) {
+            continue;
+        }
+        const size_t second = field(pos + lead, separator, 1, 2);
+        const size_t third = second ? field(pos + lead + second, separator, year_first ? 1 : 4, year_first ? 2 : 4) : 0;
+        // A fourth field makes it a version or an address, such as 1.2.2030.4
+        if (third && !field(pos + lead + second + third, separator, 1, std::string_view::npos)) {
+            date = lead + second + third;
+            break;
+        }
+    }
+
+    size_t time_start = pos;
+    if (date > 0) {
+        const size_t end = pos + date;
+        if (end + 1 >= text.size() || (text[end] != 'T' && text[end] != ' ') || count_digits(text, end + 1) == 0) {
+            return date;
+        }
+        time_start = end + 1;
+    }
+    const size_t hours = count_digits(text, time_start);
+    const size_t minutes = hours >= 1 && hours <= 2 ? field(time_start + hours, ':', 2, 2) : 0;
+    if (!minutes) {
+        return date;
+    }
+    size_t end = time_start + hours + minutes;
+    const size_t seconds = field(end, ':', 2, 2);
+    if (!seconds && date == 0) {
+        return 0;   // A lone H:MM is as often a verse, a score or a ratio
+    }
+    if (seconds) {
+        end += seconds;
+        end += field(end, '.', 1, 9);
+    }
+    if (end < text.size() && text[end] == 'Z' &&
+        (end + 1 == text.size() || !std::isalnum(static_cast<unsigned char>(text[end + 1])))) {
+        ++end;
+    }
+    return end - pos;
+}
+
+/**
+ * @brief Returns the numbers of a prompt other than dates and times, separated by spaces.
+ *
+ * A fuzzy cache hit must have the same numbers as the request, since a different number
+ * usually asks for a different answer.
+ */
+std::string prompt_numbers(std::string_view prompt) {
+    std::string numbers;
+    for (size_t i = 0; i < prompt.size();) {
+        const size_t digits = count_digits(prompt, i);
+        if (digits == 0) {
+            ++i;
+            continue;
+        }
+        const size_t timestamp = i == 0 || !std::isalnum(static_cast<unsigned char>(prompt[i - 1])) ? timestamp_length(prompt, i) : 0;
+        if (timestamp == 0) {
+            numbers.append(prompt, i, digits).append(1, ' ');
+        }
+        i += std::max(timestamp, digits);
+    }
+    return numbers;
+}
+
+/**
+ * @brief Computes the SimHash of a prompt for near-duplicate detection.
+ *
+ * The prompt is normalized first: ASCII letters are lowercased, every date and time of day
+ * counts as the same word, and whitespace and punctuation only separate words. So prompts
+ * that differ in spacing, case or timestamps get the same SimHash, while other numbers are
+ * words like any other. The features are the words and the pairs of adjacent words. The
+ * per-bit vote is a branch-free loop over 64 counters that compilers vectorize.
+ * @param prompt The prompt.
+ * @return The SimHash. Similar prompts have SimHashes that differ in few bits.
+ */
+uint64_t prompt_simhash(std::string_view prompt) {
+    int32_t votes[64] = {};
+    auto vote = [&votes](uint64_t feature) {
+        feature = mix_hash(feature);
+        for (int bit = 0; bit < 64; ++bit) {
+            votes[bit] += static_cast<int32_t>((feature >> bit) & 1) * 2 - 1;
+        }
+    };
+
+    uint64_t previous_word = 0;
+    uint64_t word = 0;
+    bool in_word = false;
+    auto end_word = [&]() {
+        if (in_word) {
+            vote(word);
+            if (previous_word != 0) {
+                vote(previous_word * 31 + word);
+            }
+            previous_word = word;
+            in_word = false;
+        }
+    };
+    for (size_t i = 0; i < prompt.size(); ++i) {
+        const auto byte = static_cast<unsigned char>(prompt[i]);
+        const bool digit = byte >= '0' && byte <= '9';
+        if (digit && !in_word) {
+            // A date or time is one word, whatever its digits
+            if (const size_t timestamp = timestamp_length(prompt, i)) {
+                word = fnv1a_hash("<timestamp>");
+                in_word = true;
+                end_word();
+                i += timestamp - 1;
+                continue;
+            }
+        }
+        if (digit || (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || byte >= 0x80) {
+            if (!in_word) {
+                word = 0xcbf29ce484222325ULL;
+                in_word = true;
+            }
+            const unsigned char lower = (byte >= 'A' && byte <= 'Z') ? byte + ('a' - 'A') : byte;
+            word = (word ^ lower) * 0x100000001b3ULL;
+        } else {
+            end_word();
+        }
+    }
+    end_word();
+
+    uint64_t simhash = 0;
+    for (int bit = 0; bit < 64; ++bit) {
+        simhash |= static_cast<uint64_t>(votes[bit] > 0) << bit;
+    }
+    return simhash;
+}
+
+/**
+ * @brief A cached answer found by ResponseCache::lookup().
+ */
+struct CacheHit {
+    std::string response;
+    std::string cached_prompt;   // The prompt the answer was generated for
+    double similarity = 1.0;     // SimHash similarity of the prompts, 1 for an exact hit
+    bool fuzzy = false;          // Whether the answer is for a different, similar prompt
+    uint64_t entry = 0;          // The index of the cache entry, for auditing
+};
+
+/**
+ * @brief A complete cache entry, as read by ResponseCache::read_all().
+ */
+struct CacheEntry {
+    std::string model;
+    std::string system_prompt;
+    std::string prompt;
+    std::string response;
+    bool deterministic = false;
+    bool valid = false;          // False if the record could not be read or decompressed
+};
+
+/**
+ * @brief Persistent cache of chat responses with an exact and an optional fuzzy tier.
+ *
+ * When built with CMDGPT_WITH_ZSTD, answers are stored zstd-compressed with the cache's
+ * trained dictionary, if there is one (see `cmdgpt cache train-dict`), whenever that makes
+ * them smaller.
+ * The exact tier serves answers to requests with the same model, system prompt and prompt.
+ * The fuzzy tier also serves answers to prompts that are near-duplicates, as measured by the
+ * Hamming distance of their SimHashes, but only for deterministic (temperature 0) requests
+ * and answers, and only with the same model and system prompt.
+ *
+ * Lookups scan the memory-mapped index newest-first. Each entry is 40 bytes and the fuzzy
+ * comparison is an XOR and a popcount, so a scan runs at memory bandwidth; a million entries
+ * take a few milliseconds.
+ */
+class ResponseCache {
+public:
+    /**
+     * @param dir The cache directory. It is created if it does not exist.
+     * @param similarity The minimum SimHash similarity, between 0 and 1, of a fuzzy hit.
+     *                   0 disables the fuzzy tier.
+     */
+    explicit ResponseCache(std::string dir, double similarity = 0)
+        : dir_(std::move(dir)),
+          max_distance_(similarity > 0 ? static_cast<int>((1.0 - similarity) * 64 + 1e-9) : -1) {
+        mkdir(dir_.c_str(), 0755);
+    }
+
+    ~ResponseCache() {
+#ifdef CMDGPT_WITH_ZSTD
+        ZSTD_freeCDict(cdict_);
+        for (const auto& [id, ddict] : ddicts_) {
+            ZSTD_freeDDict(ddict);
+        }
+#endif
+    }
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    /**
+     * @return The cache directory.
+     */
+    const std::string& dir() const { return dir_; }
+
+    /**
+     * @brief Looks up the answer to a request.
+     * @param model The model of the request.
+     * @param system_prompt The system prompt of the request.
+     * @param prompt The prompt of the request.
+     * @param deterministic Whether the request asks for temperature 0; only then may the
+     *                      fuzzy tier answer it.
+     * @param hit A reference that receives the cached answer.
+     * @return True if an answer was found.
+     */
+    bool lookup(std::string_view model, std::string_view system_prompt, std::string_view prompt, bool deterministic,
+                CacheHit& hit) const {
+        size_t size = 0;
+        const char* mapping = map_file(dir_ + CACHE_INDEX_FILE, size);
+        if (!mapping) {
+            return false;
+        }
+        const CacheIndexEntry* entries = nullptr;
+        const size_t count = index_entries_of(mapping, size, entries);
+
+        const uint64_t key_hash = cache_key_hash(model, system_prompt, prompt);
+        bool found = false;
+        for (size_t i = count; i-- > 0;) {
+            if (entries[i].key_hash == key_hash && read_record(entries[i], model, system_prompt, prompt, hit)) {
+                hit.entry = i;
+                found = true;
+                break;
+            }
+        }
+        if (!found && deterministic && max_distance_ >= 0) {
+            found = fuzzy_lookup(entries, count, model, system_prompt, prompt, hit);
+        }
+        munmap(const_cast<char*>(mapping), size);
+        return found;
+    }
+
+    /**
+     * @brief Adds the answer to a request to the cache.
+     * @param deterministic Whether the answer was generated at temperature 0.
+     * @return True if the answer was written.
+     */
+    bool store(std::string_view model, std::string_view system_prompt, std::string_view prompt, std::string_view response,
+               bool deterministic) {
+        std::vector<std::string> records(1);
+        std::vector<CacheIndexEntry> entries(1);
+        encode(model, system_prompt, prompt, response, deterministic, records[0], entries[0]);
+        return append(records, entries);
+    }
+
+    /**
+     * @brief Adds many answers to the cache at once.
+     *
+     * The entries are hashed on all cores and sorted by key hash, so that duplicates, within
+     * the batch or already in the cache, are found by merging instead of by lookups. Only the
+     * remaining ones are encoded and compressed, again on all cores, and they are appended
+     * under a single lock with a few large writes. Of several answers to a prompt, the one
+     * already cached or else the first one is kept.
+     * @param entries The answers to add. Entries that are not valid are skipped.
+     * @param added A reference that receives the number of entries added.
+     * @param duplicates A reference that receives the number of entries skipped as duplicates.
+     * @return False if the cache could not be written.
+     */
+    bool store_all(const std::vector<CacheEntry>& entries, size_t& added, size_t& duplicates) {
+        // Hash first, so that duplicates are dropped before the costlier encoding and compression
+        constexpr size_t min_entries_per_thread = 1024;
+        std::vector<uint64_t> key_hashes_of(entries.size());
+        parallel_for_slices(entries.size(), parallel_slice_count(entries.size(), min_entries_per_thread),
+                            [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (entries[i].valid) {
+                    key_hashes_of[i] = cache_key_hash(entries[i].model, entries[i].system_prompt, entries[i].prompt);
+                }
+            }
+        });
+
+        // Sort by key hash, keeping the first answer to a prompt, as the cache keeps the one it has
+        std::vector<size_t> order;
+        order.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].valid) {
+                order.push_back(i);
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return key_hashes_of[a] != key_hashes_of[b] ? key_hashes_of[a] < key_hashes_of[b] : a < b;
+        });
+        // Entries cached by now are checked here without the lock; later ones by append()
+        std::vector<uint64_t> cached;
+        const size_t checked_count = key_hashes(cached);
+        auto cached_it = cached.begin();
+        std::vector<size_t> selected;
+        size_t run_start = 0;   // The first selected entry with the current key hash
+        duplicates = 0;
+        for (size_t n = 0; n < order.size(); ++n) {
+            const CacheEntry& entry = entries[order[n]];
+            const uint64_t key_hash = key_hashes_of[order[n]];
+            while (cached_it != cached.end() && *cached_it < key_hash) {
+                ++cached_it;
+            }
+            if (selected.empty() || key_hashes_of[selected.back()] != key_hash) {
+                run_start = selected.size();
+            }
+            // Within the batch the keys themselves are compared, so a hash collision loses nothing
+            bool duplicate = cached_it != cached.end() && *cached_it == key_hash;
+            for (size_t k = run_start; k < selected.size() && !duplicate; ++k) {
+                const CacheEntry& kept = entries[selected[k]];
+                duplicate = kept.prompt == entry.prompt && kept.model == entry.model && kept.system_prompt == entry.system_prompt;
+            }
+            if (duplicate) {
+                ++duplicates;
+            } else {
+                selected.push_back(order[n]);
+            }
+        }
+
+        std::vector<std::string> new_records(selected.size());
+        std::vector<CacheIndexEntry> new_entries(selected.size());
+        parallel_for_slices(selected.size(), parallel_slice_count(selected.size(), min_entries_per_thread),
+                            [&](size_t, size_t begin, size_t end) {
+            for (size_t n = begin; n < end; ++n) {
+                const CacheEntry& entry = entries[selected[n]];
+                encode(entry.model, entry.system_prompt, entry.prompt, entry.response, entry.deterministic, new_records[n], new_entries[n]);
+            }
+        });
+        size_t late_duplicates = 0;
+        const bool ok = new_entries.empty() || append(new_records, new_entries, checked_count, &late_duplicates);
+        added = new_entries.size();
+        duplicates += late_duplicates;
+        return ok;
+    }
+
+    /**
+     * @brief Reads every entry of the cache, oldest first, decompressing answers on all cores.
+     * @param entries A reference that receives the entries. Unreadable ones are not valid.
+     * @return False if the cache is missing or is not a cmdgpt response cache.
+     */
+    bool read_all(std::vector<CacheEntry>& entries) const {
+        return for_each_batch(std::numeric_limits<size_t>::max(), [&entries](std::vector<CacheEntry>& batch) {
+            entries = std::move(batch);
+        });
+    }
+
+    /**
+     * @brief Reads every entry of the cache, oldest first, in batches.
+     *
+     * The files are memory-mapped, and the answers of each batch are decompressed on all cores.
+     * @param batch_size The number of entries per batch.
+     * @param on_batch Called with each batch, a std::vector<CacheEntry>&. Entries that could
+     *                 not be read are not valid.
+     * @return False if the cache is missing or is not a cmdgpt response cache.
+     */
+    template <typename Handler>
+    bool for_each_batch(size_t batch_size, Handler&& on_batch) const {
+        size_t index_size = 0;
+        const char* index = map_file(dir_ + CACHE_INDEX_FILE, index_size);
+        if (!index) {
+            return false;
+        }
+        const CacheIndexEntry* index_entries = nullptr;
+        const size_t count = index_entries_of(index, index_size, index_entries);
+        if (!index_entries) {
+            munmap(const_cast<char*>(index), index_size);
+            return false;
+        }
+        size_t data_size = 0;
+        const char* data = count > 0 ? map_file(dir_ + CACHE_DATA_FILE, data_size) : nullptr;
+        if (data) {
+            madvise(const_cast<char*>(data), data_size, MADV_SEQUENTIAL);
+        }
+
+        std::vector<CacheEntry> entries;
+        constexpr size_t min_entries_per_thread = 4096;
+        for (size_t first = 0; first < count; first += batch_size) {
+            const size_t batch_count = std::min(batch_size, count - first);
+            entries.assign(batch_count, CacheEntry());
+            parallel_for_slices(batch_count, parallel_slice_count(batch_count, min_entries_per_thread), [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const CacheIndexEntry& index_entry = index_entries[first + i];
+                    CacheRecordView view;
+                    if (!data || index_entry.offset > data_size || index_entry.size > data_size - index_entry.offset ||
+                        !parse_cache_record(std::string_view(data + index_entry.offset, index_entry.size), view)) {
+                        continue;
+                    }
+                    CacheEntry& entry = entries[i];
+                    if (!decode_response(index_entry, view.response, entry.response)) {
+                        continue;
+                    }
+                    entry.model = view.model;
+                    entry.system_prompt = view.system_prompt;
+                    entry.prompt = view.prompt;
+                    entry.deterministic = index_entry.flags & CACHE_ENTRY_DETERMINISTIC;
+                    entry.valid = true;
+                }
+            });
+            on_batch(entries);
+        }
+
+        if (data) {
+            munmap(const_cast<char*>(data), data_size);
+        }
+        munmap(const_cast<char*>(index), index_size);
+        return true;
+    }
+
+private:
+    /**
+     * @brief Reads the key hashes of the index entries from a given one on, sorted.
+     * @param hashes A reference that receives the hashes.
+     * @param first The first entry to read.
+     * @return The number of entries in the index.
+     */
+    size_t key_hashes(std::vector<uint64_t>& hashes, size_t first = 0) const {
+        hashes.clear();
+        size_t size = 0;
+        const char* index = map_file(dir_ + CACHE_INDEX_FILE, size);
+        if (!index) {
+            return 0;
+        }
+        const CacheIndexEntry* entries = nullptr;
+        const size_t count = index_entries_of(index, size, entries);
+        hashes.reserve(count > first ? count - first : 0);
+        for (size_t i = first; i < count; ++i) {
+            hashes.push_back(entries[i].key_hash);
+        }
+        munmap(const_cast<char*>(index), size);
+        std::sort(hashes.begin(), hashes.end());
+        return count;
+    }
+
+    /**
+     * @brief Builds the record and index entry of an answer, compressing it if that helps.
+     * @param record A reference that receives the record.
+     * @param entry A reference that receives the index entry, except for its offset.
+     */
+    void encode(std::string_view model, std::string_view system_prompt, std::string_view prompt, std::string_view response,
+                bool deterministic, std::string& record, CacheIndexEntry& entry) const {
+        entry = CacheIndexEntry{};
+        entry.flags = deterministic ? CACHE_ENTRY_DETERMINISTIC : 0;
+        std::string compressed;
+        std::string_view stored_response = response;
+        if (compress(response, compressed)) {
+            stored_response = compressed;
+            entry.flags |= CACHE_ENTRY_ZSTD;
+        }
+
+        CacheRecordHeader header{};
+        header.model_size = static_cast<uint32_t>(model.size());
+        header.system_prompt_size = static_cast<uint32_t>(system_prompt.size());
+        header.prompt_size = static_cast<uint32_t>(prompt.size());
+        header.response_size = static_cast<uint32_t>(stored_response.size());
+        record.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+        record.reserve(sizeof(header) + model.size() + system_prompt.size() + prompt.size() + stored_response.size());
+        record.append(model).append(system_prompt).append(prompt).append(stored_response);
+
+        entry.key_hash = cache_key_hash(model, system_prompt, prompt);
+        entry.context_hash = cache_context_hash(model, system_prompt);
+        entry.simhash = prompt_simhash(prompt);
+        entry.size = static_cast<uint32_t>(record.size());
+    }
+
+    /**
+     * @brief Checks the header of a mapped index.
+     * @param entries A reference that receives the first entry, or null if the index is invalid.
+     * @return The number of entries.
+     */
+    size_t index_entries_of(const char* index, size_t size, const CacheIndexEntry*& entries) const {
+        entries = nullptr;
+        if (size < sizeof(CacheIndexHeader)) {
+            return 0;
+        }
+        const auto* header = reinterpret_cast<const CacheIndexHeader*>(index);
+        if (std::memcmp(header->magic, CACHE_INDEX_MAGIC, sizeof(CACHE_INDEX_MAGIC)) != 0 ||
+            header->version != CACHE_VERSION || header->entry_size != sizeof(CacheIndexEntry)) {
+            gLogger->warn("Warning: {} is not a cmdgpt response cache; ignoring it.", dir_);
+            return 0;
+        }
+        entries = reinterpret_cast<const CacheIndexEntry*>(header + 1);
+        return (size - sizeof(CacheIndexHeader)) / sizeof(CacheIndexEntry);
+    }
+
+    /**
+     * @brief Finds the most similar deterministic answer with the same model and system prompt.
+     *
+     * Candidates within the distance limit are tried nearest first, newest first among equals,
+     * until one can be read and has the same numbers as the prompt.
+     */
+    bool fuzzy_lookup(const CacheIndexEntry* entries, size_t count, std::string_view model, std::string_view system_prompt,
+                      std::string_view prompt, CacheHit& hit) const {
+        const uint64_t context_hash = cache_context_hash(model, system_prompt);
+        const uint64_t simhash = prompt_simhash(prompt);
+        std::vector<std::pair<int, size_t>> candidates;
+        for (size_t i = count; i-- > 0;) {
+            const CacheIndexEntry& entry = entries[i];
+            if (entry.context_hash != context_hash || !(entry.flags & CACHE_ENTRY_DETERMINISTIC)) {
+                continue;
+            }
+            const int distance = __builtin_popcountll(entry.simhash ^ simhash);
+            if (distance <= max_distance_) {
+                candidates.emplace_back(distance, i);
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        const std::string numbers = prompt_numbers(prompt);
+        for (const auto& [distance, index] : candidates) {
+            if (!read_record(entries[index], model, system_prompt, {}, hit)) {
+                continue;
+            }
+            if (prompt_numbers(hit.cached_prompt) != numbers) {
+                gLogger->debug("Debug: Cache entry #{} is similar but has different numbers", index);
+                continue;
+            }
+            hit.similarity = 1.0 - distance / 64.0;
+            hit.fuzzy = true;
+            hit.entry = index;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Reads the record of an entry and checks it against the request.
+     * @param prompt The prompt the record must have, or empty to accept any prompt.
+     */
+    bool read_record(const CacheIndexEntry& entry, std::string_view model, std::string_view system_prompt,
+                     std::string_view prompt, CacheHit& hit) const {
+        const int fd = open((dir_ + CACHE_DATA_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        std::string data(entry.size, '\0');
+        const bool complete = pread(fd, data.data(), data.size(), static_cast<off_t>(entry.offset)) == static_cast<ssize_t>(data.size());
+        close(fd);
+        if (!complete) {
+            return false;
+        }
+        CacheRecordView view;
+        if (!parse_cache_record(data, view) || view.model != model || view.system_prompt != system_prompt ||
+            (!prompt.empty() && view.prompt != prompt) || !decode_response(entry, view.response, hit.response)) {
+            return false;
+        }
+        hit.cached_prompt = view.prompt;
+        hit.similarity = 1.0;
+        hit.fuzzy = false;
+        return true;
+    }
+
+    /**
+     * @brief Turns the stored answer of an entry back into text.
+     */
+    bool decode_response(const CacheIndexEntry& entry, std::string_view stored, std::string& response) const {
+        if (!(entry.flags & CACHE_ENTRY_ZSTD)) {
+            response = stored;
+            return true;
+        }
+        return decompress(stored, response);
+    }
+
+    /**
+     * @brief Compresses an answer with the current dictionary, if there is one.
+     * @return True if the compressed answer is smaller than the original.
+     */
+    bool compress(std::string_view response, std::string& compressed) const {
+#ifdef CMDGPT_WITH_ZSTD
+        const ZSTD_CDict* cdict = compression_dictionary();
+        compressed.resize(ZSTD_compressBound(response.size()));
+        ZSTD_CCtx* cctx = thread_compression_context();
+        const size_t size = cdict
+            ? ZSTD_compress_usingCDict(cctx, compressed.data(), compressed.size(), response.data(), response.size(), cdict)
+            : ZSTD_compressCCtx(cctx, compressed.data(), compressed.size(), response.data(), response.size(), CACHE_COMPRESSION_LEVEL);
+        if (ZSTD_isError(size) || size >= response.size()) {
+            return false;
+        }
+        compressed.resize(size);
+        return true;
+#else
+        (void)response;
+        (void)compressed;
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Decompresses an answer, with the dictionary named in its frame header.
+     */
+    bool decompress(std::string_view frame, std::string& response) const {
+#ifdef CMDGPT_WITH_ZSTD
+        const unsigned long long size = ZSTD_getFrameContentSize(frame.data(), frame.size());
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+            return false;
+        }
+        // Records have 32-bit sizes, so a larger content size comes from a damaged frame
+        if (size > std::numeric_limits<uint32_t>::max()) {
+            gLogger->debug("Debug: Cache entry claims {} bytes uncompressed", size);
+            return false;
+        }
+        const unsigned dict_id = ZSTD_getDictID_fromFrame(frame.data(), frame.size());
+        const ZSTD_DDict* ddict = dict_id != 0 ? decompression_dictionary(dict_id) : nullptr;
+        if (dict_id != 0 && !ddict) {
+            gLogger->debug("Debug: Cache dictionary {} is missing", dict_id);
+            return false;
+        }
+        response.resize(size);
+        ZSTD_DCtx* dctx = thread_decompression_context();
+        const size_t result = ddict
+            ? ZSTD_decompress_usingDDict(dctx, response.data(), response.size(), frame.data(), frame.size(), ddict)
+            : ZSTD_decompressDCtx(dctx, response.data(), response.size(), frame.data(), frame.size());
+        return !ZSTD_isError(result) && result == size;
+#else
+        (void)frame;
+        (void)response;
+        gLogger->debug("Debug: Cache entry is zstd-compressed; rebuild cmdgpt with CMDGPT_WITH_ZSTD to read it");
+        return false;
+#endif
+    }
+
+#ifdef CMDGPT_WITH_ZSTD
+    /**
+     * @brief Loads the current dictionary on first use. Returns null if there is none.
+     */
+    const ZSTD_CDict* compression_dictionary() const {
+        std::call_once(cdict_once_, [this] {
+            std::ifstream in(dir_ + CACHE_DICT_FILE, std::ios::binary);
+            const std::string dict((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (!dict.empty()) {
+                cdict_ = ZSTD_createCDict(dict.data(), dict.size(), CACHE_COMPRESSION_LEVEL);
+            }
+        });
+        return cdict_;
+    }
+
+    /**
+     * @brief Loads a dictionary by its id on first use. Returns null if it is missing.
+     *
+     * Called for every compressed entry, also by parallel readers. Once a dictionary is
+     * loaded they look it up under a shared lock, so they do not wait for each other.
+     */
+    const ZSTD_DDict* decompression_dictionary(unsigned id) const {
+        {
+            std::shared_lock<std::shared_mutex> lock(ddicts_mutex_);
+            const auto it = ddicts_.find(id);
+            if (it != ddicts_.end()) {
+                return it->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(ddicts_mutex_);
+        const auto it = ddicts_.find(id);
+        if (it != ddicts_.end()) {
+            return it->second;
+        }
+        std::ifstream in(dir_ + CACHE_DICT_FILE + "-" + std::to_string(id), std::ios::binary);
+        const std::string dict((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        ZSTD_DDict* ddict = dict.empty() ? nullptr : ZSTD_createDDict(dict.data(), dict.size());
+        ddicts_.emplace(id, ddict);
+        return ddict;
+    }
+#endif
+
+    /**
+     * @brief Writes a whole buffer, continuing after partial writes.
+     */
+    static bool write_all(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            const ssize_t written = write(fd, data, size);
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Appends records to the data file and their entries to the index, under one lock.
+     *
+     * The records are written first, so a reader never sees an entry whose record is missing.
+     * @param records The records. Duplicates found under the lock are removed.
+     * @param entries The index entries of the records; their offsets are filled in.
+     * @param checked_count If given, the caller has checked the records against this many
+     *                      index entries. Entries appended since by other writers are checked
+     *                      under the lock, and records with their keys are dropped.
+     * @param late_duplicates A reference that receives the number of records dropped.
+     */
+    bool append(std::vector<std::string>& records, std::vector<CacheIndexEntry>& entries,
+                size_t checked_count = std::numeric_limits<size_t>::max(), size_t* late_duplicates = nullptr) {
+        // Records are gathered into buffers of this size, so a bulk append takes few writes
+        constexpr size_t write_buffer_size = 8 * 1024 * 1024;
+        const int index_fd = open((dir_ + CACHE_INDEX_FILE).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (index_fd < 0) {
+            return false;
+        }
+        const int data_fd = open((dir_ + CACHE_DATA_FILE).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (data_fd < 0) {
+            close(index_fd);
+            return false;
+        }
+        bool ok = flock(index_fd, LOCK_EX) == 0;
+        struct stat st;
+        if (ok && fstat(index_fd, &st) == 0) {
+            if (st.st_size == 0) {
+                CacheIndexHeader header{};
+                std::memcpy(header.magic, CACHE_INDEX_MAGIC, sizeof(header.magic));
+                header.version = CACHE_VERSION;
+                header.entry_size = sizeof(CacheIndexEntry);
+                ok = write(index_fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+            } else if (static_cast<size_t>(st.st_size) >= sizeof(CacheIndexHeader) &&
+                       (st.st_size - sizeof(CacheIndexHeader)) % sizeof(CacheIndexEntry) != 0) {
+                // Drop a torn entry left by an interrupted writer, so the entries stay aligned
+                ok = ftruncate(index_fd, st.st_size - (st.st_size - sizeof(CacheIndexHeader)) % sizeof(CacheIndexEntry)) == 0;
+            }
+        }
+        if (ok && checked_count != std::numeric_limits<size_t>::max()) {
+            std::vector<uint64_t> recent;
+            key_hashes(recent, checked_count);
+            size_t kept = 0;
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (std::binary_search(recent.begin(), recent.end(), entries[i].key_hash)) {
+                    continue;
+                }
+                if (kept != i) {
+                    records[kept] = std::move(records[i]);
+                    entries[kept] = entries[i];
+                }
+                ++kept;
+            }
+            if (late_duplicates) {
+                *late_duplicates = entries.size() - kept;
+            }
+            records.resize(kept);
+            entries.resize(kept);
+        }
+        ok = ok && fstat(data_fd, &st) == 0;
+        if (ok) {
+            uint64_t offset = static_cast<uint64_t>(st.st_size);
+            std::string buffer;
+            for (size_t i = 0; i < records.size() && ok; ++i) {
+                entries[i].offset = offset;
+                offset += records[i].size();
+                buffer += records[i];
+                if (buffer.size() >= write_buffer_size || i + 1 == records.size()) {
+                    ok = write_all(data_fd, buffer.data(), buffer.size());
+                    buffer.clear();
+                }
+            }
+            ok = ok && write_all(index_fd, reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(CacheIndexEntry));
+        }
+        close(data_fd);
+        close(index_fd);
+        return ok;
+    }
+
+    std::string dir_;
+    int max_distance_;   // The largest SimHash distance of a fuzzy hit, -1 if fuzzy hits are off
+#ifdef CMDGPT_WITH_ZSTD
+    // Dictionaries are loaded on first use and shared by all threads
+    mutable std::once_flag cdict_once_;
+    mutable ZSTD_CDict* cdict_ = nullptr;
+    mutable std::shared_mutex ddicts_mutex_;
+    mutable std::map<unsigned, ZSTD_DDict*> ddicts_;
+#endif
+};
+
+/**
+ * @brief Returns the default response cache directory, ~/.cmdgpt_cache.
+ */
+std::string default_cache_dir() {
+    const char* home = getenv("HOME");
+    return std::string(home ? home : ".") + "/.cmdgpt_cache";
+}
+
+// Binary log file layout: BINARY_LOG_MAGIC, then blocks. A block is a BinaryLogBlockHeader
+// followed by its (possibly compressed) records. Each block is written with a single write()
+// to a file opened with O_APPEND, so processes sharing a log never interleave their records.
+// A block that a crash or a full disk tore fails its checksum; readers then resume at the
+// next LOG_BLOCK_MAGIC.
+constexpr char BINARY_LOG_MAGIC[8] = {'C', 'G', 'P', 'T', 'B', 'L', 'G', '2'};
+constexpr char LOG_BLOCK_MAGIC[4] = {'C', 'G', 'B', 'K'};
+constexpr uint8_t LOG_BLOCK_RAW = 0;
+constexpr uint8_t LOG_BLOCK_ZSTD = 1;
+constexpr size_t LOG_BLOCK_SIZE = 64 * 1024;
+constexpr uint64_t DEFAULT_LOG_MAX_SIZE = 10 * 1024 * 1024;
+constexpr int DEFAULT_LOG_MAX_FILES = 3;
+
+struct BinaryLogBlockHeader {
+    char magic[4];          // LOG_BLOCK_MAGIC
+    uint32_t stored_size;   // bytes following this header
+    uint32_t raw_size;      // bytes of records after decompression
+    uint32_t checksum;      // CRC-32 of this header, with checksum 0, and the stored bytes
+    uint8_t compression;    // LOG_BLOCK_RAW or LOG_BLOCK_ZSTD
+    uint8_t reserved[3];
+};
+
+struct BinaryLogRecordHeader {
+    uint32_t size;          // bytes of the record including this header
+    uint8_t level;          // spdlog::level::level_enum
+    uint8_t reserved[3];
+    int64_t timestamp_us;   // Unix time in microseconds
+};
+static_assert(sizeof(BinaryLogBlockHeader) == 20, "binary log block layout must not change");
+static_assert(sizeof(BinaryLogRecordHeader) == 16, "binary log record layout must not change");
+
+// Record fields follow the record header. Each starts with a tag byte, (field id << 1) | wire type,
+// followed by a varint value or by a varint length and that many bytes. Unknown fields are skipped.
+constexpr uint8_t LOG_WIRE_VARINT = 0;
+constexpr uint8_t LOG_WIRE_BYTES = 1;
+constexpr uint8_t LOG_FIELD_MESSAGE = 1;
+constexpr uint8_t LOG_FIELD_PID = 2;
+constexpr uint8_t LOG_FIELD_THREAD = 3;
+
+/**
+ * @brief Computes the CRC-32 (IEEE 802.3) of a buffer.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @param crc The CRC-32 of the bytes before these, to continue from.
+ * @return The CRC-32.
+ */
+uint32_t compute_crc32(const char* data, size_t size, uint32_t crc = 0) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> entries{};
+        for (uint32_t i = 0; i < entries.size(); ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = value & 1 ? 0xedb88320u ^ (value >> 1) : value >> 1;
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Appends an unsigned LEB128 varint to a buffer.
+ */
+void append_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+/**
+ * @brief Reads an unsigned LEB128 varint.
+ * @param pos The read position, advanced past the varint.
+ * @param end The end of the buffer.
+ * @param value A reference that receives the value.
+ * @return False if the buffer ends inside the varint.
+ */
+bool read_varint(const char*& pos, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        const auto byte = static_cast<unsigned char>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief spdlog sink writing the compact binary log format, with size-based rotation.
+ *
+ * Records are collected in memory and written as one block when LOG_BLOCK_SIZE is reached,
+ * on flush and on destruction. When built with CMDGPT_WITH_ZSTD each block is compressed.
+ * The file is appended to, never truncated; once it exceeds max_size it is rotated to
+ * FILE.1, FILE.2, ... keeping max_files files in total.
+ */
+template <typename Mutex>
+class BinaryLogSink final : public spdlog::sinks::base_sink<Mutex> {
+public:
+    BinaryLogSink(std::string path, uint64_t max_size, int max_files)
+        : path_(std::move(path)), max_size_(max_size), max_files_(max_files), pid_(static_cast<uint64_t>(getpid())) {
+        buffer_.reserve(LOG_BLOCK_SIZE + 1024);
+        open_file();
+    }
+
+    ~BinaryLogSink() override {
+        flush_();
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+protected:
+    void sink_it_(const spdlog::details::log_msg& msg) override {
+        BinaryLogRecordHeader header{};
+        header.level = static_cast<uint8_t>(msg.level);
+        header.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(msg.time.time_since_epoch()).count();
+
+        const size_t start = buffer_.size();
+        buffer_.append(sizeof(header), '\0');
+        buffer_ += static_cast<char>(LOG_FIELD_PID << 1 | LOG_WIRE_VARINT);
+        append_varint(buffer_, pid_);
+        buffer_ += static_cast<char>(LOG_FIELD_THREAD << 1 | LOG_WIRE_VARINT);
+        append_varint(buffer_, msg.thread_id);
+        buffer_ += static_cast<char>(LOG_FIELD_MESSAGE << 1 | LOG_WIRE_BYTES);
+        append_varint(buffer_, msg.payload.size());
+        buffer_.append(msg.payload.data(), msg.payload.size());
+        header.size = static_cast<uint32_t>(buffer_.size() - start);
+        std::memcpy(&buffer_[start], &header, sizeof(header));
+
+        if (buffer_.size() >= LOG_BLOCK_SIZE) {
+            flush_();
+        }
+    }
+
+    void flush_() override {
+        if (buffer_.empty() || fd_ < 0) {
+            return;
+        }
+        BinaryLogBlockHeader header{};
+        std::memcpy(header.magic, LOG_BLOCK_MAGIC, sizeof(header.magic));
+        header.raw_size = static_cast<uint32_t>(buffer_.size());
+        header.compression = LOG_BLOCK_RAW;
+        block_.assign(sizeof(header), '\0');
+#ifdef CMDGPT_WITH_ZSTD
+        block_.resize(sizeof(header) + ZSTD_compressBound(buffer_.size()));
+        const size_t compressed = ZSTD_compress(&block_[sizeof(header)], block_.size() - sizeof(header),
+                                                buffer_.data(), buffer_.size(), 3);
+        if (!ZSTD_isError(compressed) && compressed < buffer_.size()) {
+            block_.resize(sizeof(header) + compressed);
+            header.compression = LOG_BLOCK_ZSTD;
+        } else {
+            block_.resize(sizeof(header));
+            block_ += buffer_;
+        }
+#else
+        block_ += buffer_;
+#endif
+        header.stored_size = static_cast<uint32_t>(block_.size() - sizeof(header));
+        std::memcpy(&block_[0], &header, sizeof(header));
+        header.checksum = compute_crc32(block_.data(), block_.size());
+        std::memcpy(&block_[0], &header, sizeof(header));
+        buffer_.clear();
+
+        struct stat st;
+        if (fstat(fd_, &st) == 0 && static_cast<uint64_t>(st.st_size) + block_.size() > max_size_ &&
+            static_cast<size_t>(st.st_size) > sizeof(BINARY_LOG_MAGIC)) {
+            rotate();
+        }
+        if (fd_ >= 0 && write(fd_, block_.data(), block_.size()) < 0) {
+            // Nowhere left to report the failure; drop the block
+            return;
+        }
+    }
+
+private:
+    void open_file() {
+        fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            spdlog::throw_spdlog_ex("Failed opening log file " + path_, errno);
+        }
+        // Only one of several processes creating the log at once may write the magic
+        flock(fd_, LOCK_EX);
+        struct stat st;
+        if (fstat(fd_, &st) == 0 && st.st_size == 0) {
+            if (write(fd_, BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC)) < 0) {
+                spdlog::throw_spdlog_ex("Failed writing log file " + path_, errno);
+            }
+        }
+        flock(fd_, LOCK_UN);
+    }
+
+    void rotate() {
+        flock(fd_, LOCK_EX);
+        // Another process may have rotated the file already; then only reopen
+        struct stat ours, current;
+        if (fstat(fd_, &ours) == 0 && stat(path_.c_str(), &current) == 0 &&
+            ours.st_ino == current.st_ino && ours.st_dev == current.st_dev) {
+            for (int i = max_files_ - 1; i > 0; --i) {
+                const std::string from = i == 1 ? path_ : path_ + "." + std::to_string(i - 1);
+                std::rename(from.c_str(), (path_ + "." + std::to_string(i)).c_str());
+            }
+            if (max_files_ <= 1) {
+                std::remove(path_.c_str());
+            }
+        }
+        flock(fd_, LOCK_UN);
+        close(fd_);
+        fd_ = -1;
+        try {
+            open_file();
+        } catch (const spdlog::spdlog_ex&) {
+            fd_ = -1;
+        }
+    }
+
+    std::string path_;
+    uint64_t max_size_;
+    int max_files_;
+    uint64_t pid_;
+    int fd_ = -1;
+    std::string buffer_;
+    std::string block_;
+};
+
+/**
+ * @brief Returns the default log file path, ~/.cmdgpt_log.bin.
+ */
+std::string default_log_file() {
+    const char* home = getenv("HOME");
+    return std::string(home ? home : ".") + "/.cmdgpt_log.bin";
+}
 
 /**
- * @brief Prints the help message to the console.
+ * @brief Makes buffered log records reach the log file when cmdgpt ends abnormally.
+ *
+ * An uncaught exception flushes gLogger before the default terminate handler runs.
+ * SIGINT, SIGTERM and SIGHUP are blocked and waited for by a dedicated thread, which
+ * flushes gLogger outside of signal context and then lets the signal end the process
+ * as before. Must be called before other threads are started, so they inherit the mask.
  */
-void print_help() {
-    std::cout << "Usage: cmdgpt [options] [prompt]\n"
-              << "Options:\n"
-              << "  -h, --help              Show this help message and exit\n"
-              << "  -k, --api_key KEY       Set the OpenAI API key to KEY\n"
-              << "  -s, --sys_prompt PROMPT Set the system prompt to PROMPT\n"
-              << "  -l, --log_file FILE     Set the log file to FILE\n"
-              << "  -m, --gpt_model MODEL   Set the GPT model to MODEL\n"
-              << "  -L, --log_level LEVEL   Set the log level to LEVEL\n"
-              << "                          (TRACE, DEBUG, INFO, WARN, ERROR, CRITICAL)\n"
-              << "  -v, --version           Print the version of the program and exit\n"
-              << "prompt:\n"
-              << "  The text prompt to send to the OpenAI GPT API. If not provided, the program will read from stdin.\n";
+void install_log_flush_handlers() {
+    static std::terminate_handler previous_terminate = nullptr;
+    previous_terminate = std::set_terminate([] {
+        if (gLogger) {
+            gLogger->flush();
+        }
+        if (previous_terminate) {
+            previous_terminate();
+        }
+        std::abort();
+    });
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (const int signal : {SIGINT, SIGTERM, SIGHUP}) {
+        sigaddset(&signals, signal);
+    }
+    if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0) {
+        return;
+    }
+    std::thread([signals] {
+        int signal = 0;
+        if (sigwait(&signals, &signal) != 0) {
+            return;
+        }
+        if (gLogger) {
+            gLogger->flush();
+        }
+        std::signal(signal, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+        raise(signal);
+    }).detach();
 }
 
 /**
- * @brief Sends a message to the GPT Chat API and returns the HTTP response status code.
- * @param prompt The text prompt to send to the API.
- * @param response A reference to a string where the API response will be stored.
- * @param api_key The API key for the OpenAI GPT API. Default is an empty string.
- * @param system_prompt The system prompt for the OpenAI GPT API. Default is an empty string.
- * @param model The GPT model to use. Default is DEFAULT_MODEL.
- * @return The HTTP response status code, or EMPTY_RESPONSE_CODE if no response was received.
- * @throws std::invalid_argument If no API key was provided.
+ * @brief Checks the block at a position of a binary log.
+ * @param data The contents of the log file.
+ * @param pos The position of the block header.
+ * @param block A reference that receives the block header.
+ * @return False if no intact block starts at pos.
  */
-int get_gpt_chat_response(const std::string& prompt, std::string& response, const std::string& api_key = "", const std::string& system_prompt = "", const std::string& model = DEFAULT_MODEL) {
-    // Declare the required variables at the beginning of the function
-    json res_json;
-    std::string finish_reason;
+bool read_binary_log_block(const std::string& data, size_t pos, BinaryLogBlockHeader& block) {
+    if (pos + sizeof(block) > data.size()) {
+        return false;
+    }
+    std::memcpy(&block, data.data() + pos, sizeof(block));
+    if (std::memcmp(block.magic, LOG_BLOCK_MAGIC, sizeof(block.magic)) != 0 ||
+        block.stored_size > data.size() - pos - sizeof(block)) {
+        return false;
+    }
+    BinaryLogBlockHeader unchecked = block;
+    unchecked.checksum = 0;
+    const uint32_t crc = compute_crc32(reinterpret_cast<const char*>(&unchecked), sizeof(unchecked));
+    return compute_crc32(data.data() + pos + sizeof(block), block.stored_size, crc) == block.checksum;
+}
 
-    // API key and system prompt must be provided
-    if (api_key.empty() || system_prompt.empty()) {
-        throw std::invalid_argument("API key and system prompt must be provided.");
+/**
+ * @brief Prints the records of one binary log file as text.
+ *
+ * Damaged blocks, such as one torn by a crash, are skipped and reading resumes at the
+ * next intact block.
+ * @param path The log file.
+ * @return True if the file was read completely.
+ */
+bool print_binary_log(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Error: Cannot open log file " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.compare(0, sizeof(BINARY_LOG_MAGIC), BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC)) != 0) {
+        std::cerr << "Error: " << path << " is not a cmdgpt binary log.\n";
+        return false;
     }
 
-    // Setup headers for the POST request
-    httplib::Headers headers = {
-        { AUTHORIZATION_HEADER, "Bearer " + api_key },
-        { CONTENT_TYPE_HEADER, APPLICATION_JSON }
-    };
+    std::string records;
+    size_t pos = sizeof(BINARY_LOG_MAGIC);
+    size_t damaged = 0;     // bytes skipped
+    bool ok = true;
+    while (pos < data.size()) {
+        BinaryLogBlockHeader block;
+        if (!read_binary_log_block(data, pos, block)) {
+            const size_t next = data.find(std::string_view(LOG_BLOCK_MAGIC, sizeof(LOG_BLOCK_MAGIC)), pos + 1);
+            const size_t resume = next == std::string::npos ? data.size() : next;
+            damaged += resume - pos;
+            pos = resume;
+            continue;
+        }
+        pos += sizeof(block);
+        const size_t stored = pos;
+        pos += block.stored_size;
+        if (block.compression == LOG_BLOCK_RAW) {
+            records.assign(data, stored, block.stored_size);
+        } else if (block.compression == LOG_BLOCK_ZSTD) {
+#ifdef CMDGPT_WITH_ZSTD
+            records.resize(block.raw_size);
+            const size_t size = ZSTD_decompress(&records[0], records.size(), data.data() + stored, block.stored_size);
+            if (ZSTD_isError(size) || size != block.raw_size) {
+                std::cerr << "Error: Corrupt compressed block in " << path << ".\n";
+                ok = false;
+                continue;
+            }
+#else
+            std::cerr << "Error: " << path << " contains zstd blocks; rebuild cmdgpt with CMDGPT_WITH_ZSTD.\n";
+            return false;
+#endif
+        } else {
+            std::cerr << "Error: Unknown block compression " << int(block.compression) << " in " << path << ".\n";
+            ok = false;
+            continue;
+        }
 
-    // Prepare the JSON data for the POST request
-    json data = {
-        {MODEL_KEY, model},
-        {MESSAGES_KEY, {
-            {{ROLE_KEY, SYSTEM_ROLE}, {CONTENT_KEY, system_prompt}},
-            {{ROLE_KEY, USER_ROLE}, {CONTENT_KEY, prompt}}
-        }}
-    };
+        const char* record = records.data();
+        const char* records_end = record + records.size();
+        while (record + sizeof(BinaryLogRecordHeader) <= records_end) {
+            BinaryLogRecordHeader header;
+            std::memcpy(&header, record, sizeof(header));
+            if (header.size < sizeof(header) || record + header.size > records_end) {
+                std::cerr << "Error: Corrupt record in " << path << ".\n";
+                ok = false;
+                break;
+            }
+            uint64_t pid = 0;
+            uint64_t thread = 0;
+            std::string_view message;
+            const char* field = record + sizeof(header);
+            const char* record_end = record + header.size;
+            while (field < record_end) {
+                const auto tag = static_cast<uint8_t>(*field++);
+                uint64_t value;
+                if (!read_varint(field, record_end, value)) {
+                    break;
+                }
+                if ((tag & 1) == LOG_WIRE_BYTES) {
+                    if (value > static_cast<uint64_t>(record_end - field)) {
+                        break;
+                    }
+                    if (tag >> 1 == LOG_FIELD_MESSAGE) {
+                        message = std::string_view(field, value);
+                    }
+                    field += value;
+                } else if (tag >> 1 == LOG_FIELD_PID) {
+                    pid = value;
+                } else if (tag >> 1 == LOG_FIELD_THREAD) {
+                    thread = value;
+                }
+            }
 
-    // Initialize the HTTP client
-    httplib::Client cli(SERVER_URL);
+            const std::time_t seconds = static_cast<std::time_t>(header.timestamp_us / 1000000);
+            std::tm local{};
+            localtime_r(&seconds, &local);
+            char time_text[32];
+            std::strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M:%S", &local);
+            const auto level_name = spdlog::level::to_string_view(static_cast<spdlog::level::level_enum>(header.level));
+            std::cout << '[' << time_text << '.' << std::setw(6) << std::setfill('0') << header.timestamp_us % 1000000
+                      << std::setfill(' ') << "] [" << std::string_view(level_name.data(), level_name.size())
+                      << "] [" << pid << ':' << thread << "] " << message << '\n';
+            record = record_end;
+        }
+    }
+    if (damaged > 0) {
+        std::cerr << "Warning: Skipped " << damaged << " bytes of damaged blocks in " << path << ".\n";
+        ok = false;
+    }
+    return ok;
+}
 
-    // Log the data being sent
-    gLogger->debug("Debug: Sending POST request to {} with data: {}", URL, data.dump());
+/**
+ * @brief Implements `cmdgpt logcat`: prints binary log files as text.
+ * @param argc The number of command-line arguments after "logcat".
+ * @param argv The command-line arguments after "logcat", the log files to print.
+ * @param log_file The log to print, with its rotated files oldest first, if no files are given.
+ * @return The exit code of the application.
+ */
+int run_logcat_command(int argc, char* argv[], const std::string& log_file) {
+    std::vector<std::string> files(argv, argv + argc);
+    if (files.empty()) {
+        for (int i = DEFAULT_LOG_MAX_FILES - 1; i > 0; --i) {
+            const std::string rotated = log_file + "." + std::to_string(i);
+            if (access(rotated.c_str(), R_OK) == 0) {
+                files.push_back(rotated);
+            }
+        }
+        files.push_back(log_file);
+    }
+    bool ok = true;
+    for (const auto& file : files) {
+        ok = print_binary_log(file) && ok;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Send the POST request
-    auto res = cli.Post(URL, headers, data.dump(), APPLICATION_JSON);
+/**
+ * @brief Returns the default usage ledger path, ~/.cmdgpt_usage.ledger.
+ */
+std::string default_ledger_file() {
+    const char* home = getenv("HOME");
+    return std::string(home ? home : ".") + "/.cmdgpt_usage.ledger";
+}
 
-    // If response is received from the server
-    if (res) {
-        gLogger->debug("Debug: Received HTTP response with status {} and body: {}", res->status, res->body);
-        // Handle the HTTP response status code
-        switch (res->status) {
-            case HTTP_OK:
-                // Everything is fine
-                break;
-            case HTTP_BAD_REQUEST:
-                gLogger->error("Error: Bad request.");
-                return res->status;
-            case HTTP_UNAUTHORIZED:
-                gLogger->error("Error: Unauthorized. Check your API key.");
-                return res->status;
-            case HTTP_FORBIDDEN:
-                gLogger->error("Error: Forbidden. You do not have the necessary permissions.");
-                return res->status;
-            case HTTP_NOT_FOUND:
-                gLogger->error("Error: Not Found. The requested URL was not found on the server.");
-                return res->status;
-            case HTTP_INTERNAL_SERVER_ERROR:
-                gLogger->error("Error: Internal Server Error. The server encountered an unexpected condition.");
-                return res->status;
-            default:
-                gLogger->error("Error: Received unexpected HTTP status code: {}", res->status);
-                return res->status;
+/**
+ * @brief Aggregates ledger records in parallel, grouped by a key derived from each record.
+ * @param records The records, typically a memory-mapped ledger.
+ * @param count The number of records.
+ * @param key_of A function returning the group key of a record.
+ * @return The totals per group, in key order.
+ */
+template <typename Key, typename KeyOf>
+std::map<Key, UsageTotals> aggregate_usage(const LedgerRecord* records, size_t count, KeyOf key_of) {
+    // Small ledgers are not worth starting threads for
+    constexpr size_t min_records_per_thread = 65536;
+    const size_t slice_count = parallel_slice_count(count, min_records_per_thread);
+
+    // Each thread aggregates its own slice into its own table; the tables are merged at the end
+    std::vector<std::unordered_map<Key, UsageTotals>> partials(slice_count);
+    parallel_for_slices(count, slice_count, [&](size_t slice, size_t begin, size_t end) {
+        auto& partial = partials[slice];
+        for (size_t i = begin; i < end; ++i) {
+            partial[key_of(records[i])].add(records[i]);
+        }
+    });
+
+    std::map<Key, UsageTotals> totals;
+    for (const auto& partial : partials) {
+        for (const auto& [key, partial_totals] : partial) {
+            totals[key].add(partial_totals);
+        }
+    }
+    return totals;
+}
+
+/**
+ * @brief Prints one row of the usage report.
+ */
+void print_usage_row(const std::string& group, const UsageTotals& totals) {
+    std::cout << std::left << std::setw(32) << group << std::right
+              << std::setw(10) << totals.requests
+              << std::setw(14) << totals.prompt_tokens
+              << std::setw(12) << totals.cached_tokens
+              << std::setw(14) << totals.completion_tokens
+              << std::setw(12) << std::fixed << std::setprecision(4) << totals.cost_micro_usd / 1e6
+              << std::setw(10) << (totals.requests ? totals.latency_ms / totals.requests : 0) << "\n";
+}
+
+/**
+ * @brief Prints a usage report, one row per group and a total row.
+ * @param totals The totals per group.
+ * @param format_key A function turning a group key into its display name.
+ */
+template <typename Key, typename FormatKey>
+void print_usage_report(const std::map<Key, UsageTotals>& totals, FormatKey format_key) {
+    UsageTotals sum;
+    std::cout << std::left << std::setw(32) << "GROUP" << std::right
+              << std::setw(10) << "REQUESTS" << std::setw(14) << "PROMPT" << std::setw(12) << "CACHED"
+              << std::setw(14) << "COMPLETION" << std::setw(12) << "COST_USD" << std::setw(10) << "AVG_MS" << "\n";
+    for (const auto& [key, group_totals] : totals) {
+        print_usage_row(format_key(key), group_totals);
+        sum.add(group_totals);
+    }
+    print_usage_row("TOTAL", sum);
+}
+
+/**
+ * @brief Implements `cmdgpt usage`: reports the token usage and cost recorded in a ledger.
+ * @param argc The number of command-line arguments after "usage".
+ * @param argv The command-line arguments after "usage".
+ * @param ledger_file The ledger to read unless --ledger is given.
+ * @return The exit code of the application.
+ */
+int run_usage_command(int argc, char* argv[], std::string ledger_file) {
+    std::string group_by = "model";
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--by" && i + 1 < argc) {
+            group_by = argv[++i];
+        } else if (arg == "--ledger" && i + 1 < argc) {
+            ledger_file = argv[++i];
+        } else {
+            std::cerr << "Usage: cmdgpt usage [--by model|day|tag] [--ledger FILE]\n";
+            return EXIT_USAGE_ERROR;
         }
+    }
+    if (group_by != "model" && group_by != "day" && group_by != "tag") {
+        std::cerr << "Error: --by must be one of model, day, tag.\n";
+        return EXIT_USAGE_ERROR;
+    }
+
+    const int fd = open(ledger_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open usage ledger " << ledger_file << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(LedgerHeader)) {
+        close(fd);
+        std::cout << "No usage recorded.\n";
+        return EXIT_SUCCESS;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error: Cannot map usage ledger " << ledger_file << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const auto* header = static_cast<const LedgerHeader*>(mapping);
+    if (std::memcmp(header->magic, LEDGER_MAGIC, sizeof(LEDGER_MAGIC)) != 0 ||
+        header->version != LEDGER_VERSION || header->record_size != sizeof(LedgerRecord)) {
+        munmap(mapping, size);
+        std::cerr << "Error: " << ledger_file << " is not a cmdgpt usage ledger.\n";
+        return EXIT_FAILURE;
+    }
+    const auto* records = reinterpret_cast<const LedgerRecord*>(header + 1);
+    const size_t count = (size - sizeof(LedgerHeader)) / sizeof(LedgerRecord);
+
+    if (group_by == "day") {
+        constexpr int64_t ms_per_day = 86400000;
+        auto totals = aggregate_usage<int64_t>(records, count, [](const LedgerRecord& record) {
+            return record.timestamp_ms / ms_per_day;
+        });
+        print_usage_report(totals, [](int64_t day) {
+            const std::time_t seconds = static_cast<std::time_t>(day * 86400);
+            std::tm utc{};
+            gmtime_r(&seconds, &utc);
+            char date[16];
+            std::strftime(date, sizeof(date), "%Y-%m-%d", &utc);
+            return std::string(date);
+        });
     } else {
-        gLogger->debug("Debug: No response received from the server.");
-        return EMPTY_RESPONSE_CODE;
+        const bool by_tag = group_by == "tag";
+        auto totals = aggregate_usage<std::string_view>(records, count, [by_tag](const LedgerRecord& record) {
+            return by_tag ? ledger_field(record.tag) : ledger_field(record.model);
+        });
+        print_usage_report(totals, [](std::string_view key) {
+            return key.empty() ? std::string("(none)") : std::string(key);
+        });
     }
 
-    // If response body is not empty
-    if (!res->body.empty()) {
-        // Parse the JSON response
-        res_json = json::parse(res->body);
+    munmap(mapping, size);
+    return EXIT_SUCCESS;
+}
 
-        // If 'choices' array is empty
-        if (res_json[CHOICES_KEY].empty()) {
-            gLogger->error("Error: '{}' array is empty.", CHOICES_KEY);
-            return EMPTY_RESPONSE_CODE;
+#ifdef CMDGPT_WITH_ZSTD
+/**
+ * @brief The stored size and decompression time of a set of answers.
+ */
+struct CompressionTrial {
+    uint64_t stored_bytes = 0;
+    double decompress_us = 0;   // Average per answer
+};
+
+/**
+ * @brief Compresses and decompresses sample answers, with a dictionary if one is given.
+ * @param samples The answers, concatenated.
+ * @param sample_sizes The size of each answer.
+ * @param dict The dictionary, or empty for none.
+ * @return The total stored size, counting an answer that does not shrink at its raw size,
+ *         and the average decompression time.
+ */
+CompressionTrial run_compression_trial(const std::string& samples, const std::vector<size_t>& sample_sizes, const std::string& dict) {
+    ZSTD_CDict* cdict = dict.empty() ? nullptr : ZSTD_createCDict(dict.data(), dict.size(), CACHE_COMPRESSION_LEVEL);
+    ZSTD_DDict* ddict = dict.empty() ? nullptr : ZSTD_createDDict(dict.data(), dict.size());
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    CompressionTrial trial;
+    std::string compressed;
+    std::string decompressed;
+    std::chrono::nanoseconds decompress_time{0};
+    size_t offset = 0;
+    for (const size_t size : sample_sizes) {
+        const char* sample = samples.data() + offset;
+        offset += size;
+        compressed.resize(ZSTD_compressBound(size));
+        const size_t compressed_size = cdict
+            ? ZSTD_compress_usingCDict(cctx, compressed.data(), compressed.size(), sample, size, cdict)
+            : ZSTD_compressCCtx(cctx, compressed.data(), compressed.size(), sample, size, CACHE_COMPRESSION_LEVEL);
+        if (ZSTD_isError(compressed_size) || compressed_size >= size) {
+            trial.stored_bytes += size;
+            continue;
         }
-        // If 'finish_reason' field is missing
-        if (!res_json[CHOICES_KEY][0].contains(FINISH_REASON_KEY)) {
-            gLogger->error("Error: '{}' field is missing.", FINISH_REASON_KEY);
-            return EMPTY_RESPONSE_CODE;
+        trial.stored_bytes += compressed_size;
+        decompressed.resize(size);
+        const auto start = std::chrono::steady_clock::now();
+        if (ddict) {
+            ZSTD_decompress_usingDDict(dctx, decompressed.data(), size, compressed.data(), compressed_size, ddict);
+        } else {
+            ZSTD_decompressDCtx(dctx, decompressed.data(), size, compressed.data(), compressed_size);
         }
-        // If 'content' field is missing
-        if (!res_json[CHOICES_KEY][0]["message"].contains(CONTENT_KEY)) {
-            gLogger->error("Error: '{}' field is missing.", CONTENT_KEY);
-            return EMPTY_RESPONSE_CODE;
+        decompress_time += std::chrono::steady_clock::now() - start;
+    }
+    trial.decompress_us = sample_sizes.empty() ? 0 : decompress_time.count() / 1000.0 / sample_sizes.size();
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDDict(ddict);
+    ZSTD_freeCDict(cdict);
+    return trial;
+}
+
+/**
+ * @brief Writes a file in one piece, replacing it atomically if it exists.
+ */
+bool write_file_atomically(const std::string& path, std::string_view contents) {
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out.write(contents.data(), static_cast<std::streamsize>(contents.size())) || !out.flush()) {
+            return false;
         }
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+#endif
 
-        // Extract 'finish_reason' and 'content'
-        finish_reason = res_json[CHOICES_KEY][0][FINISH_REASON_KEY].get<std::string>();
-        gLogger->debug("Finish reason: {}", finish_reason);
-        response = res_json[CHOICES_KEY][0]["message"][CONTENT_KEY].get<std::string>();
+/**
+ * @brief Implements `cmdgpt cache train-dict`: trains a zstd dictionary on the cached answers
+ *        and installs it for new entries.
+ *
+ * Reports the stored size and decompression time of the sample answers without and with the
+ * dictionary, so that the dictionary size can be tuned.
+ * @param cache The response cache.
+ * @param dict_size The maximum dictionary size in bytes.
+ * @return The exit code of the application.
+ */
+int train_cache_dictionary(const ResponseCache& cache, size_t dict_size) {
+#ifdef CMDGPT_WITH_ZSTD
+    // zstd recommends about a hundred times the dictionary size in samples, at least a few dozen
+    constexpr size_t min_samples = 32;
+    const auto read_start = std::chrono::steady_clock::now();
+    std::vector<CacheEntry> entries;
+    if (!cache.read_all(entries)) {
+        std::cerr << "Error: There is no response cache in " << cache.dir() << ".\n";
+        return EXIT_FAILURE;
     }
+    const auto read_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - read_start);
+    std::cout << "Read " << entries.size() << " cache entries in " << read_time.count() << " ms.\n";
 
-    return res->status;
+    // The newest answers are the most representative of what will be cached next
+    std::string samples;
+    std::vector<size_t> sample_sizes;
+    for (auto it = entries.rbegin(); it != entries.rend() && samples.size() < dict_size * 100; ++it) {
+        if (it->valid && !it->response.empty()) {
+            samples += it->response;
+            sample_sizes.push_back(it->response.size());
+        }
+    }
+    if (sample_sizes.size() < min_samples) {
+        std::cerr << "Error: Training a dictionary needs at least " << min_samples << " cached answers, there are "
+                  << sample_sizes.size() << ".\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string dict(dict_size, '\0');
+    const size_t trained_size = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(), sample_sizes.data(),
+                                                      static_cast<unsigned>(sample_sizes.size()));
+    if (ZDICT_isError(trained_size)) {
+        std::cerr << "Error: Dictionary training failed: " << ZDICT_getErrorName(trained_size) << "\n";
+        return EXIT_FAILURE;
+    }
+    dict.resize(trained_size);
+    const unsigned dict_id = ZDICT_getDictID(dict.data(), dict.size());
+
+    const CompressionTrial plain = run_compression_trial(samples, sample_sizes, "");
+    const CompressionTrial with_dict = run_compression_trial(samples, sample_sizes, dict);
+    std::cout << "Trained dictionary " << dict_id << " (" << dict.size() << " bytes) on " << sample_sizes.size()
+              << " answers (" << samples.size() << " bytes).\n"
+              << std::left << std::setw(16) << "COMPRESSION" << std::right << std::setw(14) << "STORED_BYTES"
+              << std::setw(8) << "RATIO" << std::setw(16) << "DECOMPRESS_US" << "\n";
+    for (const auto& [name, trial] : {std::make_pair("none", CompressionTrial{samples.size(), 0}),
+                                      std::make_pair("zstd", plain), std::make_pair("zstd+dict", with_dict)}) {
+        std::cout << std::left << std::setw(16) << name << std::right << std::setw(14) << trial.stored_bytes
+                  << std::setw(8) << std::fixed << std::setprecision(2)
+                  << static_cast<double>(samples.size()) / std::max<uint64_t>(trial.stored_bytes, 1)
+                  << std::setw(16) << trial.decompress_us << "\n";
+    }
+
+    // Keep every dictionary under its id, for the entries compressed with it
+    const std::string dict_file = cache.dir() + CACHE_DICT_FILE;
+    if (!write_file_atomically(dict_file + "-" + std::to_string(dict_id), dict) || !write_file_atomically(dict_file, dict)) {
+        std::cerr << "Error: Cannot write " << dict_file << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "New cache entries are compressed with it; existing entries keep their compression.\n";
+    return EXIT_SUCCESS;
+#else
+    (void)cache;
+    (void)dict_size;
+    std::cerr << "Error: Dictionary training needs zstd; rebuild cmdgpt with CMDGPT_WITH_ZSTD.\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * @brief Implements `cmdgpt cache import`: bulk-loads prompt/answer pairs from JSONL files.
+ *
+ * Each line is an object with "prompt" and "response" strings and optionally "model",
+ * "system_prompt" and "temperature". Lines are parsed on all cores and added in large
+ * batches with ResponseCache::store_all(). Prompts that are already cached are skipped.
+ * @param cache The response cache.
+ * @param files The files to import; none or "-" reads stdin.
+ * @param model The model of lines that do not name one.
+ * @param system_prompt The system prompt of lines that do not have one.
+ * @return The exit code of the application.
+ */
+int import_cache(ResponseCache& cache, std::vector<std::string> files, const std::string& model, const std::string& system_prompt) {
+    // Lines are parsed and stored in batches of this many, to bound the memory used
+    constexpr size_t batch_lines = 256 * 1024;
+    constexpr size_t min_lines_per_thread = 1024;
+    const auto start = std::chrono::steady_clock::now();
+    size_t imported = 0;
+    size_t duplicates = 0;
+    std::atomic<size_t> invalid{0};
+    if (files.empty()) {
+        files.push_back("-");
+    }
+    for (const std::string& file : files) {
+        std::string input;
+        size_t size = 0;
+        const char* data = nullptr;
+        bool mapped = false;
+        struct stat st;
+        if (file != "-" && stat(file.c_str(), &st) != 0) {
+            std::cerr << "Error: Cannot read " << file << ": " << std::strerror(errno) << "\n";
+            return EXIT_FAILURE;
+        }
+        if (file == "-" || !S_ISREG(st.st_mode)) {
+            // Streams, including pipes and FIFOs such as <(zcat dump.jsonl.gz), have no size to map
+            std::ifstream in;
+            if (file != "-") {
+                in.open(file, std::ios::binary);
+                if (!in) {
+                    std::cerr << "Error: Cannot read " << file << ": " << std::strerror(errno) << "\n";
+                    return EXIT_FAILURE;
+                }
+            }
+            std::istream& stream = file == "-" ? std::cin : in;
+            input.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+            data = input.data();
+            size = input.size();
+        } else if (st.st_size == 0) {
+            continue;   // An empty file
+        } else if (!(data = map_file(file, size))) {
+            std::cerr << "Error: Cannot read " << file << ": " << std::strerror(errno) << "\n";
+            return EXIT_FAILURE;
+        } else {
+            mapped = true;
+            madvise(const_cast<char*>(data), size, MADV_SEQUENTIAL);
+        }
+
+        std::vector<std::string_view> lines;
+        std::vector<CacheEntry> entries;
+        size_t pos = 0;
+        bool ok = true;
+        while (pos < size && ok) {
+            // Split the next batch of lines
+            lines.clear();
+            while (pos < size && lines.size() < batch_lines) {
+                const void* newline = std::memchr(data + pos, '\n', size - pos);
+                const size_t end = newline ? static_cast<const char*>(newline) - data : size;
+                if (end > pos) {
+                    lines.emplace_back(data + pos, end - pos);
+                }
+                pos = end + 1;
+            }
+
+            entries.assign(lines.size(), CacheEntry());
+            parallel_for_slices(lines.size(), parallel_slice_count(lines.size(), min_lines_per_thread), [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const json line = json::parse(lines[i], nullptr, false);
+                    // Optional fields must be strings too; value() would throw on anything else
+                    if (!line.is_object() || !line.contains(PROMPT_KEY) || !line[PROMPT_KEY].is_string() ||
+                        !line.contains(RESPONSE_KEY) || !line[RESPONSE_KEY].is_string() ||
+                        (line.contains(MODEL_KEY) && !line[MODEL_KEY].is_string()) ||
+                        (line.contains(SYSTEM_PROMPT_KEY) && !line[SYSTEM_PROMPT_KEY].is_string())) {
+                        invalid.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    CacheEntry& entry = entries[i];
+                    entry.model = line.value(MODEL_KEY, model);
+                    entry.system_prompt = line.value(SYSTEM_PROMPT_KEY, system_prompt);
+                    entry.prompt = line[PROMPT_KEY].get<std::string>();
+                    entry.response = line[RESPONSE_KEY].get<std::string>();
+                    entry.deterministic = line.contains(TEMPERATURE_KEY) && line[TEMPERATURE_KEY].is_number() &&
+                                          line[TEMPERATURE_KEY].get<double>() == 0;
+                    entry.valid = true;
+                }
+            });
+
+            size_t added = 0;
+            size_t skipped = 0;
+            ok = cache.store_all(entries, added, skipped);
+            imported += added;
+            duplicates += skipped;
+        }
+        if (mapped) {
+            munmap(const_cast<char*>(data), size);
+        }
+        if (!ok) {
+            std::cerr << "Error: Cannot write to the response cache in " << cache.dir() << ": " << std::strerror(errno) << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Imported " << imported << " entries (" << duplicates << " already cached, " << invalid.load()
+              << " invalid lines) in " << elapsed.count() << " ms.\n";
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Implements `cmdgpt cache export`: writes the cache to stdout as JSONL.
+ *
+ * The lines have the format read by import_cache(). The cache is read in batches that are
+ * decompressed and formatted on all cores, and written in order.
+ * @param cache The response cache.
+ * @return The exit code of the application.
+ */
+int export_cache(const ResponseCache& cache) {
+    constexpr size_t batch_entries = 64 * 1024;
+    constexpr size_t min_entries_per_thread = 1024;
+    size_t exported = 0;
+    size_t unreadable = 0;
+    std::vector<std::string> slices;
+    const bool found = cache.for_each_batch(batch_entries, [&](std::vector<CacheEntry>& entries) {
+        const size_t slice_count = parallel_slice_count(entries.size(), min_entries_per_thread);
+        slices.assign(slice_count, std::string());
+        parallel_for_slices(entries.size(), slice_count, [&](size_t slice, size_t begin, size_t end) {
+            std::string& out = slices[slice];
+            for (size_t i = begin; i < end; ++i) {
+                const CacheEntry& entry = entries[i];
+                if (!entry.valid) {
+                    continue;
+                }
+                out += "{\"";
+                out += MODEL_KEY;
+                out += "\":";
+                append_json_string(out, entry.model);
+                out += ",\"";
+                out += SYSTEM_PROMPT_KEY;
+                out += "\":";
+                append_json_string(out, entry.system_prompt);
+                out += ",\"";
+                out += PROMPT_KEY;
+                out += "\":";
+                append_json_string(out, entry.prompt);
+                out += ",\"";
+                out += RESPONSE_KEY;
+                out += "\":";
+                append_json_string(out, entry.response);
+                if (entry.deterministic) {
+                    out += ",\"";
+                    out += TEMPERATURE_KEY;
+                    out += "\":0";
+                }
+                out += "}\n";
+            }
+        });
+        for (const std::string& slice : slices) {
+            std::cout.write(slice.data(), static_cast<std::streamsize>(slice.size()));
+        }
+        for (const CacheEntry& entry : entries) {
+            ++(entry.valid ? exported : unreadable);
+        }
+    });
+    std::cout.flush();
+    if (!found) {
+        std::cerr << "Error: There is no response cache in " << cache.dir() << ".\n";
+        return EXIT_FAILURE;
+    }
+    if (unreadable > 0) {
+        gLogger->warn("Warning: Skipped {} unreadable cache entries.", unreadable);
+    }
+    gLogger->info("Exported {} cache entries.", exported);
+    return std::cout ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Implements `cmdgpt cache`: maintenance of the response cache.
+ * @param argc The number of command-line arguments after "cache".
+ * @param argv The command-line arguments after "cache".
+ * @param cache_dir The cache directory unless --cache-dir is given.
+ * @param model The model of imported answers unless -m is given or a line names one.
+ * @param system_prompt The system prompt of imported answers unless -s is given or a line has one.
+ * @return The exit code of the application.
+ */
+int run_cache_command(int argc, char* argv[], std::string cache_dir, std::string model, std::string system_prompt) {
+    const char* usage = "Usage: cmdgpt cache train-dict [--size KIB] [--cache-dir DIR]\n"
+                        "       cmdgpt cache import [-m MODEL] [-s PROMPT] [--cache-dir DIR] [FILE...]\n"
+                        "       cmdgpt cache export [--cache-dir DIR]\n";
+    if (argc < 1) {
+        std::cerr << usage;
+        return EXIT_USAGE_ERROR;
+    }
+    const std::string command = argv[0];
+    size_t dict_size = DEFAULT_CACHE_DICT_SIZE;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--cache-dir" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if ((arg == "-m" || arg == "--gpt_model") && i + 1 < argc && command == "import") {
+            model = argv[++i];
+        } else if ((arg == "-s" || arg == "--sys_prompt") && i + 1 < argc && command == "import") {
+            system_prompt = argv[++i];
+        } else if (command == "import" && (arg == "-" || arg[0] != '-')) {
+            files.push_back(arg);
+        } else if (arg == "--size" && i + 1 < argc && command == "train-dict") {
+            char* end = nullptr;
+            const long kib = std::strtol(argv[++i], &end, 10);
+            if (*end != '\0' || kib <= 0) {
+                std::cerr << "Error: --size needs a positive number of KiB.\n";
+                return EXIT_USAGE_ERROR;
+            }
+            dict_size = static_cast<size_t>(kib) * 1024;
+        } else {
+            std::cerr << usage;
+            return EXIT_USAGE_ERROR;
+        }
+    }
+
+    // Diagnostics go to stderr, so that they never mix with data written to stdout
+    gLogger = std::make_shared<spdlog::logger>("cache", std::make_shared<spdlog::sinks::ansicolor_stderr_sink_mt>());
+    gLogger->set_level(DEFAULT_LOG_LEVEL);
+    ResponseCache cache(cache_dir);
+    if (command == "train-dict") {
+        return train_cache_dictionary(cache, dict_size);
+    } else if (command == "import") {
+        return import_cache(cache, files, model, system_prompt);
+    } else if (command == "export") {
+        return export_cache(cache);
+    }
+    std::cerr << usage;
+    return EXIT_USAGE_ERROR;
 }
 
+// The unit tests include this file and bring their own main()
+#ifndef CMDGPT_NO_MAIN
 /**
  * @brief The main function of the application.
  * @param argc The number of command-line arguments.
@@ -207,10 +3770,20 @@ int get_gpt_chat_response(const std::string& prompt, std::string& response, cons
  * @return The exit code of the application.
  */
 int main(int argc, char* argv[]) {
-    std::string api_key;
+    ApiKeyPool api_keys;
+    bool api_keys_from_args = false;
     std::string system_prompt;
     std::string gpt_model;
     std::string log_file;
+    std::string server_url;
+    std::string ledger_file;
+    std::string usage_tag;
+    bool stream = false;
+    bool use_cache = false;
+    std::string cache_dir;
+    double cache_similarity = 0;
+    double temperature = SERVER_DEFAULT_TEMPERATURE;
+    std::chrono::milliseconds flush_latency = DEFAULT_FLUSH_LATENCY;
     spdlog::level::level_enum log_level;
     std::string arg;
     std::string prompt;
@@ -218,12 +3791,30 @@ int main(int argc, char* argv[]) {
     int status_code;
 
     // Parse environment variables
-    api_key = getenv("OPENAI_API_KEY") ? getenv("OPENAI_API_KEY") : "";
+    api_keys.add(getenv("OPENAI_API_KEY") ? getenv("OPENAI_API_KEY") : "");
     system_prompt = getenv("OPENAI_SYSTEM_PROMPT") ? getenv("OPENAI_SYSTEM_PROMPT") : DEFAULT_SYSTEM_PROMPT;
     gpt_model = getenv("OPENAI_GPT_MODEL") ? getenv("OPENAI_GPT_MODEL") : DEFAULT_MODEL;
-    log_file = getenv("CMDGPT_LOG_FILE") ? getenv("CMDGPT_LOG_FILE") : "logfile.txt"; // Default log file
+    server_url = getenv("CMDGPT_SERVER_URL") ? getenv("CMDGPT_SERVER_URL") : SERVER_URL;
+    log_file = getenv("CMDGPT_LOG_FILE") ? getenv("CMDGPT_LOG_FILE") : default_log_file(); // Default log file
     std::string env_log_level = getenv("CMDGPT_LOG_LEVEL") ? getenv("CMDGPT_LOG_LEVEL") : "WARN"; // Default log level
-    log_level = log_levels.count(env_log_level) ? log_levels.at(env_log_level) : DEFAULT_LOG_LEVEL;
+    log_level = DEFAULT_LOG_LEVEL;
+    find_log_level(env_log_level, log_level);
+    ledger_file = getenv("CMDGPT_LEDGER_FILE") ? getenv("CMDGPT_LEDGER_FILE") : default_ledger_file();
+    usage_tag = getenv("CMDGPT_USAGE_TAG") ? getenv("CMDGPT_USAGE_TAG") : "";
+    cache_dir = getenv("CMDGPT_CACHE_DIR") ? getenv("CMDGPT_CACHE_DIR") : default_cache_dir();
+
+    // The usage subcommand only reads the ledger
+    if (argc > 1 && std::string(argv[1]) == "usage") {
+        return run_usage_command(argc - 2, argv + 2, ledger_file);
+    }
+    // The cache subcommand maintains the response cache
+    if (argc > 1 && std::string(argv[1]) == "cache") {
+        return run_cache_command(argc - 2, argv + 2, cache_dir, gpt_model, system_prompt);
+    }
+    // The logcat subcommand only reads the log
+    if (argc > 1 && std::string(argv[1]) == "logcat") {
+        return run_logcat_command(argc - 2, argv + 2, log_file);
+    }
 
     // Parsing command-line arguments
     for (int i = 1; i < argc; ++i) {
@@ -235,18 +3826,76 @@ int main(int argc, char* argv[]) {
             std::cout << "cmdgpt version: " << CMDGPT_VERSION << std::endl;
             return EXIT_SUCCESS;
         } else if (arg == "-k" || arg == "--api_key") {
-            api_key = argv[++i];
+            // Keys on the command line replace the ones from the environment
+            if (!api_keys_from_args) {
+                api_keys.clear();
+                api_keys_from_args = true;
+            }
+            api_keys.add(argv[++i]);
         } else if (arg == "-s" || arg == "--sys_prompt") {
             system_prompt = argv[++i];
         } else if (arg == "-l" || arg == "--log_file") {
             log_file = argv[++i];
         } else if (arg == "-m" || arg == "--gpt_model") {
             gpt_model = argv[++i];
-        } else if (arg == "-L" || arg == "--log_level") {
-            std::string log_level_str = argv[++i];
-            if (log_levels.count(log_level_str)) {
-                log_level = log_levels.at(log_level_str);
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--flush-ms") {
+            const char* value = i + 1 < argc ? argv[++i] : "";
+            char* end = nullptr;
+            const long ms = std::strtol(value, &end, 10);
+            if (end == value || *end != '\0' || ms < 0) {
+                std::cerr << "Error: " << arg << " needs a number of milliseconds.\n";
+                return EXIT_USAGE_ERROR;
+            }
+            flush_latency = std::chrono::milliseconds(ms);
+        } else if (arg == "-c" || arg == "--cache") {
+            use_cache = true;
+        } else if (arg == "--cache-dir") {
+            cache_dir = argv[++i];
+        } else if (arg == "--cache-similarity" || arg == "--temperature") {
+            const char* value = i + 1 < argc ? argv[++i] : "";
+            char* end = nullptr;
+            const double number = std::strtod(value, &end);
+            if (arg == "--cache-similarity") {
+                if (end == value || *end != '\0' || number <= 0 || number > 1) {
+                    std::cerr << "Error: " << arg << " needs a number between 0 and 1.\n";
+                    return EXIT_USAGE_ERROR;
+                }
+                cache_similarity = number;
+            } else {
+                if (end == value || *end != '\0' || number < 0 || number > MAX_TEMPERATURE) {
+                    std::cerr << "Error: " << arg << " needs a number between 0 and " << MAX_TEMPERATURE << ".\n";
+                    return EXIT_USAGE_ERROR;
+                }
+                temperature = number;
+            }
+        } else if (arg == "-u" || arg == "--ledger") {
+            ledger_file = argv[++i];
+        } else if (arg == "-t" || arg == "--tag") {
+            usage_tag = argv[++i];
+        } else if (arg == "--max-cost" || arg == "--max-tokens-total") {
+            const char* value = i + 1 < argc ? argv[++i] : "";
+            char* end = nullptr;
+            const double limit = std::strtod(value, &end);
+            // The budget counts whole tokens and micro-dollars, and 0 would mean unlimited
+            const double units = arg == "--max-cost" ? limit * 1e6 : limit;
+            if (end == value || *end != '\0' || !(units >= 1)) {
+                std::cerr << "Error: " << arg << " needs a number of at least "
+                          << (arg == "--max-cost" ? "0.000001" : "1") << ".\n";
+                return EXIT_USAGE_ERROR;
+            }
+            if (units >= static_cast<double>(std::numeric_limits<uint64_t>::max())) {
+                std::cerr << "Error: " << arg << " is too large.\n";
+                return EXIT_USAGE_ERROR;
             }
+            if (arg == "--max-cost") {
+                gBudget.max_cost_micro_usd = static_cast<uint64_t>(units);
+            } else {
+                gBudget.max_tokens_total = static_cast<uint64_t>(units);
+            }
+        } else if (arg == "-L" || arg == "--log_level") {
+            find_log_level(argv[++i], log_level);
         } else {
             prompt = arg;
         }
@@ -254,22 +3903,92 @@ int main(int argc, char* argv[]) {
 
     // Set up logging
     auto console_sink = std::make_shared<spdlog::sinks::ansicolor_stdout_sink_mt>();
-    auto file_sink = std::make_shared<spdlog::sinks::simple_file_sink_mt>(log_file, true);
-    gLogger = std::make_shared<spdlog::logger>("multi_sink", spdlog::sinks_init_list{console_sink, file_sink});
+    std::vector<spdlog::sink_ptr> sinks{console_sink};
+    if (!log_file.empty()) {
+        sinks.push_back(std::make_shared<BinaryLogSink<std::mutex>>(log_file, DEFAULT_LOG_MAX_SIZE, DEFAULT_LOG_MAX_FILES));
+    }
+    gLogger = std::make_shared<spdlog::logger>("multi_sink", sinks.begin(), sinks.end());
     gLogger->set_level(log_level);
+    gLogger->flush_on(spdlog::level::err);
+    install_log_flush_handlers();
+
+    // Set up usage recording
+    if (!ledger_file.empty()) {
+        gLedger = std::make_unique<UsageLedger>(ledger_file, usage_tag);
+    }
 
     // Make the API request and handle the response
     if (prompt.empty()) {
         // If no prompt was provided in the command line, read it from stdin
         std::getline(std::cin, prompt);
     }
-    status_code = get_gpt_chat_response(prompt, response, api_key, system_prompt, gpt_model);
+    // The server rejects invalid UTF-8 with a 400 only after the upload, so repair it up front
+    if (const size_t replaced = repair_utf8(prompt)) {
+        gLogger->warn("Warning: Replaced {} invalid UTF-8 sequence(s) in the prompt.", replaced);
+    }
+    if (const size_t replaced = repair_utf8(system_prompt)) {
+        gLogger->warn("Warning: Replaced {} invalid UTF-8 sequence(s) in the system prompt.", replaced);
+    }
+    DeltaHandler on_delta;
+    std::unique_ptr<OutputCoalescer> output;
+    if (stream) {
+        std::cout.flush();
+        output = std::make_unique<OutputCoalescer>(STDOUT_FILENO, flush_latency);
+        on_delta = [&output](std::string_view delta) { output->write(delta); };
+    }
+    std::unique_ptr<ResponseCache> cache;
+    if (use_cache) {
+        cache = std::make_unique<ResponseCache>(cache_dir, cache_similarity);
+    }
+    // Only answers sampled at temperature 0 are reproducible, so only they may answer similar prompts
+    const bool deterministic = temperature == 0;
+    CacheHit hit;
+    if (cache && cache->lookup(gpt_model, system_prompt, prompt, deterministic, hit)) {
+        if (hit.fuzzy) {
+            gLogger->warn("Warning: Answered from cache entry #{} for a similar prompt (similarity {:.3f}): {}",
+                          hit.entry, hit.similarity, hit.cached_prompt);
+        } else {
+            gLogger->info("Cache: Answered from cache entry #{}", hit.entry);
+        }
+        response = std::move(hit.response);
+        if (output) {
+            output->write(response);
+        }
+        status_code = HTTP_OK;
+    } else {
+        std::string finish_reason;
+        status_code = get_gpt_chat_response(prompt, response, api_keys, system_prompt, gpt_model, server_url, on_delta,
+                                            temperature, &finish_reason);
+        // Only complete answers are cached; a cut-off one would later be served as if it were whole
+        if (cache && status_code == HTTP_OK && finish_reason == "stop" &&
+            !cache->store(gpt_model, system_prompt, prompt, response, deterministic)) {
+            gLogger->warn("Warning: Could not write to the response cache: {}", std::strerror(errno));
+        }
+    }
+    if (output) {
+        output->finish();
+        gLogger->info("Output: {} bytes in {} writes, longest buffering delay {:.1f} ms",
+                      output->bytes(), output->writes(), output->max_delay().count() / 1000.0);
+    }
+    if (status_code == BUDGET_EXCEEDED_CODE) {
+        gLogger->critical("Error: Request not sent, it would exceed the budget.");
+        return 1;
+    }
     if (status_code == EMPTY_RESPONSE_CODE) {
         gLogger->critical("Error: Did not receive a response from the server.");
         return 1;
     }
-    // output the response to stdout
-    std::cout << response << std::endl;
+    // output the response to stdout; a streamed response is out already
+    if (!stream) {
+        std::cout << response;
+    }
+    std::cout << std::endl;
+    if (gLedger) {
+        const UsageTotals totals = gLedger->totals();
+        gLogger->info("Usage: {} prompt, {} completion tokens, ${:.4f}",
+                      totals.prompt_tokens, totals.completion_tokens, totals.cost_micro_usd / 1e6);
+    }
     // that's all folks...
     return 0;
 }
+#endif  // CMDGPT_NO_MAIN
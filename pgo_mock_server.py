@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+# OpenAI-compatible mock server for the PGO training workload in pgo_train.sh.
+# Usage: pgo_mock_server.py <port file>
+#
+# Listens on a free local port, writes the port number to <port file> and answers
+# POST /v1/chat/completions until it is terminated. Answers repeat words of the
+# prompt, mixed with multi-byte UTF-8, so that longer prompts get longer answers.
+# Streamed answers are written in small pieces that split events, JSON strings and
+# UTF-8 characters. A prompt containing "[cut]" has its first stream cut off part-way
+# without a finish reason, so that cmdgpt requests a continuation.
+
+import json
+import os
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+WORDS = ["café", "€5", "naïve", "\U0001f600", "résumé", "\"quoted\"", "tab\there", "line\n"]
+
+
+def make_answer(prompt):
+    words = prompt.split()[:400] or ["empty"]
+    return " ".join(word + " " + WORDS[i % len(WORDS)] for i, word in enumerate(words))
+
+
+def make_usage(messages, answer):
+    prompt_tokens = sum(len(str(message.get("content", ""))) for message in messages) // 4 + 1
+    return {"prompt_tokens": prompt_tokens, "completion_tokens": len(answer) // 4 + 1,
+            "total_tokens": prompt_tokens + len(answer) // 4 + 1,
+            "prompt_tokens_details": {"cached_tokens": prompt_tokens // 2}}
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_POST(self):
+        request = json.loads(self.rfile.read(int(self.headers.get("Content-Length", 0))))
+        messages = request.get("messages", [])
+        prompt = next((m.get("content", "") for m in messages if m.get("role") == "user"), "")
+        answer = make_answer(prompt)
+        model = request.get("model", "gpt-4o")
+        if request.get("stream"):
+            continued = any(m.get("role") == "assistant" for m in messages)
+            self.stream(model, answer, make_usage(messages, answer), cut="[cut]" in prompt and not continued)
+            return
+        body = json.dumps({
+            "id": "chatcmpl-pgo", "object": "chat.completion", "created": int(time.time()), "model": model,
+            "choices": [{"index": 0, "message": {"role": "assistant", "content": answer}, "finish_reason": "stop"}],
+            "usage": make_usage(messages, answer),
+        }, ensure_ascii=False).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def stream(self, model, answer, usage, cut):
+        def event(choices, **fields):
+            chunk = {"id": "chatcmpl-pgo", "object": "chat.completion.chunk", "model": model, "choices": choices}
+            chunk.update(fields)
+            return ("data: " + json.dumps(chunk, ensure_ascii=False) + "\n\n").encode()
+
+        events = [event([{"index": 0, "delta": {"role": "assistant"}, "logprobs": None, "finish_reason": None}])]
+        pieces = [answer[i:i + 7] for i in range(0, len(answer), 7)]
+        if cut:
+            pieces = pieces[:len(pieces) // 2]
+        for piece in pieces:
+            events.append(event([{"index": 0, "delta": {"content": piece}, "finish_reason": None}]))
+        if not cut:
+            events.append(event([{"index": 0, "delta": {}, "finish_reason": "stop"}]))
+            events.append(event([], usage=usage))
+            events.append(b"data: [DONE]\n\n")
+
+        self.send_response(200)
+        self.send_header("Content-Type", "text/event-stream")
+        self.send_header("Connection", "close")
+        self.end_headers()
+        data = b"".join(events)
+        # Odd-sized writes split events and multi-byte characters at varying offsets
+        for i in range(0, len(data), 61):
+            self.wfile.write(data[i:i + 61])
+            self.wfile.flush()
+        self.close_connection = True
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: pgo_mock_server.py <port file>", file=sys.stderr)
+        return 64
+    server = ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+    # Written whole before it appears, so the port is never read half-written
+    with open(sys.argv[1] + ".tmp", "w") as port_file:
+        port_file.write(str(server.server_address[1]))
+    os.rename(sys.argv[1] + ".tmp", sys.argv[1])
+    server.serve_forever()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# PGO training workload for cmdgpt, invoked by the pgo-train CMake target.
+# Usage: pgo_train.sh <instrumented cmdgpt binary> <profile directory>
+#
+# The workload runs the argument parser, request builder and response parser a
+# number of times, with and without streaming, and the usage, logcat and cache
+# commands. Requests go to pgo_mock_server.py, an OpenAI-compatible mock server
+# that streams answers in pieces split at awkward offsets and cuts some streams
+# off to exercise continuations. Set CMDGPT_SERVER_URL to use another server
+# instead (and OPENAI_API_KEY to any value it accepts). Without python3 and
+# without CMDGPT_SERVER_URL the requests fail fast, which still covers startup
+# and request construction.
+
+CMDGPT="$1"
+PROFILE_DIR="$2"
+
+if [ -z "$CMDGPT" ] || [ -z "$PROFILE_DIR" ]; then
+    echo "Usage: $0 <cmdgpt binary> <profile directory>"
+    exit 64
+fi
+
+export OPENAI_API_KEY="${OPENAI_API_KEY:-pgo-training-key}"
+if [ -z "$CMDGPT_SERVER_URL" ] && command -v python3 > /dev/null; then
+    PORT_FILE="$PROFILE_DIR/pgo-mock-server.port"
+    rm -f "$PORT_FILE"
+    python3 "$(dirname "$0")/pgo_mock_server.py" "$PORT_FILE" &
+    MOCK_PID=$!
+    trap 'kill $MOCK_PID 2> /dev/null' EXIT
+    for i in $(seq 1 50); do
+        [ -s "$PORT_FILE" ] && break
+        sleep 0.1
+    done
+    if [ -s "$PORT_FILE" ]; then
+        export CMDGPT_SERVER_URL="http://127.0.0.1:$(cat "$PORT_FILE")"
+    else
+        echo "The mock server did not start; training without responses"
+    fi
+fi
+export CMDGPT_SERVER_URL="${CMDGPT_SERVER_URL:-http://127.0.0.1:9}"
+# Keep the training runs out of the user's own log, usage ledger and response cache
+export CMDGPT_LOG_FILE="$PROFILE_DIR/pgo-train.log"
+export CMDGPT_LEDGER_FILE="$PROFILE_DIR/pgo-train.ledger"
+export CMDGPT_CACHE_DIR="$PROFILE_DIR/pgo-train-cache"
+rm -rf "$CMDGPT_LOG_FILE"* "$CMDGPT_LEDGER_FILE" "$CMDGPT_CACHE_DIR" "$PROFILE_DIR/pgo-train-import"
+
+# Startup and option handling
+"$CMDGPT" --help > /dev/null
+"$CMDGPT" --version > /dev/null
+
+# Request building and response handling, with short and long prompts
+LONG_PROMPT=$(printf 'Summarize the following text. %.0s' $(seq 1 200))
+for i in $(seq 1 20); do
+    "$CMDGPT" -L ERROR -m gpt-4 "Training prompt $i" > /dev/null
+    "$CMDGPT" -L DEBUG -s "You are a terse assistant." "$LONG_PROMPT" > /dev/null
+    echo "Prompt read from stdin $i" | "$CMDGPT" -L WARN > /dev/null
+done
+
+# Streaming: the SSE parser, delta parsing, output coalescing and continuations
+for i in $(seq 1 10); do
+    "$CMDGPT" --stream -t stream "Streamed prompt $i" > /dev/null
+    "$CMDGPT" --stream --flush-ms 0 -m gpt-4o-mini "$LONG_PROMPT $i" > /dev/null
+    "$CMDGPT" --stream -L ERROR "[cut] Streamed prompt $i that is cut off part-way" > /dev/null
+done
+
+# The response cache: misses, exact hits and similar prompts at temperature 0
+for round in 1 2; do
+    for i in $(seq 1 10); do
+        "$CMDGPT" -c -t cache "Cached prompt $i" > /dev/null
+        "$CMDGPT" -c --stream "$LONG_PROMPT cached $i" > /dev/null
+        "$CMDGPT" -c --temperature 0 --cache-similarity 0.9 \
+            "List the errors logged at 2024-03-0$((i % 9 + 1))T1$round:00:00Z, item $i" > /dev/null
+    done
+done
+
+# Reports over the ledger and the log written above
+"$CMDGPT" usage > /dev/null
+"$CMDGPT" usage --by day > /dev/null
+"$CMDGPT" usage --by tag > /dev/null
+"$CMDGPT" logcat "$CMDGPT_LOG_FILE" > /dev/null
+
+# Cache export and import, and dictionary training where zstd is built in
+"$CMDGPT" cache export > "$PROFILE_DIR/pgo-train-cache.jsonl"
+"$CMDGPT" cache import --cache-dir "$PROFILE_DIR/pgo-train-import" "$PROFILE_DIR/pgo-train-cache.jsonl" > /dev/null
+"$CMDGPT" cache train-dict > /dev/null 2>&1
+"$CMDGPT" cache export --cache-dir "$PROFILE_DIR/pgo-train-import" > /dev/null
+
+# Clang writes raw profiles that must be merged before the USE stage
+if ls "$PROFILE_DIR"/*.profraw > /dev/null 2>&1; then
+    if command -v llvm-profdata > /dev/null; then
+        llvm-profdata merge -output="$PROFILE_DIR/cmdgpt.profdata" "$PROFILE_DIR"/*.profraw
+    else
+        echo "llvm-profdata not found; merge $PROFILE_DIR/*.profraw into cmdgpt.profdata manually"
+        exit 1
+    fi
+fi
+
+echo "Profile data written to $PROFILE_DIR"
@@ -0,0 +1,735 @@
+// Unit tests for the parsers and on-disk formats of cmdgpt.
+//
+// cmdgpt is a single translation unit, so the tests include it with its main() left out
+// and call its functions directly. Run without arguments to run every test, or pass test
+// names to run only those.
+
+#define CMDGPT_NO_MAIN
+#include "../cmdgpt.cpp"
+
+#include <cstdlib>
+#include <sstream>
+#include "spdlog/sinks/null_sink.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                                     \
+    do {                                                                                     \
+        if (!(condition)) {                                                                  \
+            std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK(" #condition ") failed\n";  \
+            ++failures;                                                                      \
+        }                                                                                    \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                           \
+    do {                                                                                     \
+        const auto& actual_value = (actual);                                                 \
+        const auto& expected_value = (expected);                                             \
+        if (!(actual_value == expected_value)) {                                             \
+            std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK_EQ(" #actual ", " #expected \
+                      << ") failed: " << actual_value << " != " << expected_value << '\n';   \
+            ++failures;                                                                      \
+        }                                                                                    \
+    } while (0)
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& test_cases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+#define TEST(name)                                                                           \
+    void name();                                                                             \
+    const bool name##_registered = (test_cases().push_back({#name, name}), true);            \
+    void name()
+
+// UTF-8 validation and repair
+
+TEST(utf8_valid_text_is_left_alone) {
+    std::string text = "plain ASCII, caf\xc3\xa9, \xe2\x82\xac 5, \xf0\x9f\x98\x80";
+    const std::string original = text;
+    CHECK_EQ(valid_utf8_prefix(text), text.size());
+    CHECK_EQ(repair_utf8(text), 0u);
+    CHECK_EQ(text, original);
+}
+
+TEST(utf8_invalid_bytes_are_replaced) {
+    std::string stray = "a\xff" "b";
+    CHECK_EQ(repair_utf8(stray), 1u);
+    CHECK_EQ(stray, "a\xef\xbf\xbd" "b");
+
+    // Overlong forms and UTF-16 surrogates are invalid byte by byte
+    std::string overlong = "\xc0\xaf";
+    CHECK_EQ(repair_utf8(overlong), 2u);
+    std::string surrogate = "\xed\xa0\x80";
+    CHECK_EQ(repair_utf8(surrogate), 3u);
+
+    // A sequence cut off at the end is one replacement
+    std::string truncated = "ab\xe2\x82";
+    CHECK_EQ(repair_utf8(truncated), 1u);
+    CHECK_EQ(truncated, "ab\xef\xbf\xbd");
+}
+
+TEST(utf8_complete_prefix_holds_back_cut_characters) {
+    const std::string euro = "x\xe2\x82\xac";
+    const std::string emoji = "x\xf0\x9f\x98\x80";
+    for (size_t cut = 2; cut < euro.size(); ++cut) {
+        CHECK_EQ(utf8_complete_prefix(euro.substr(0, cut)), 1u);
+    }
+    for (size_t cut = 2; cut < emoji.size(); ++cut) {
+        CHECK_EQ(utf8_complete_prefix(emoji.substr(0, cut)), 1u);
+    }
+    CHECK_EQ(utf8_complete_prefix(euro), euro.size());
+    CHECK_EQ(utf8_complete_prefix(emoji), emoji.size());
+    // Invalid bytes are not held back; nothing could complete them
+    CHECK_EQ(utf8_complete_prefix("x\xff"), 2u);
+}
+
+TEST(utf8_stream_split_at_every_byte_emits_whole_characters) {
+    const std::string text = "caf\xc3\xa9 \xe2\x82\xac\xf0\x9f\x98\x80!";
+    for (size_t cut = 0; cut <= text.size(); ++cut) {
+        // The carry logic of post_streaming_request: hold back a cut-off character
+        std::string carry;
+        std::string emitted;
+        for (const std::string& piece : {text.substr(0, cut), text.substr(cut)}) {
+            std::string content = carry + piece;
+            const size_t complete = utf8_complete_prefix(content);
+            carry.assign(content, complete, std::string::npos);
+            content.resize(complete);
+            CHECK_EQ(valid_utf8_prefix(content), content.size());
+            emitted += content;
+        }
+        CHECK(carry.empty());
+        CHECK_EQ(emitted, text);
+    }
+}
+
+// Server-sent events
+
+std::vector<std::string> parse_sse(const std::vector<std::string_view>& chunks) {
+    std::vector<std::string> events;
+    SseParser parser;
+    for (const std::string_view chunk : chunks) {
+        parser.feed(chunk, [&events](std::string_view event) { events.emplace_back(event); });
+    }
+    return events;
+}
+
+TEST(sse_events_survive_every_split_point) {
+    const std::string stream =
+        ": keep-alive comment\r\n"
+        "data: {\"a\":1}\r\n\r\n"
+        "event: ignored\n"
+        "data: first line\n"
+        "data: second line\n\n"
+        "data:no space\n\n"
+        "data: [DONE]\n\n";
+    const std::vector<std::string> expected = {"{\"a\":1}", "first line\nsecond line", "no space", "[DONE]"};
+    CHECK(parse_sse({stream}) == expected);
+    for (size_t cut = 0; cut <= stream.size(); ++cut) {
+        const std::string_view view(stream);
+        if (parse_sse({view.substr(0, cut), view.substr(cut)}) != expected) {
+            std::cerr << "split at byte " << cut << '\n';
+            CHECK(false);
+        }
+    }
+    // One byte at a time
+    std::vector<std::string_view> bytes;
+    for (size_t i = 0; i < stream.size(); ++i) {
+        bytes.push_back(std::string_view(stream).substr(i, 1));
+    }
+    CHECK(parse_sse(bytes) == expected);
+}
+
+TEST(sse_incomplete_event_is_not_emitted) {
+    CHECK(parse_sse({"data: partial\n"}).empty());
+    CHECK(parse_sse({"data: partial"}).empty());
+}
+
+std::string stream_content(std::string_view data, std::string* finish_reason = nullptr) {
+    StreamDelta delta;
+    parse_stream_delta(data, delta);
+    if (finish_reason) {
+        *finish_reason = delta.finish_reason;
+    }
+    return delta.content;
+}
+
+TEST(stream_delta_content_and_finish_reason) {
+    std::string content;
+    CHECK(parse_stream_delta_fast(R"({"choices":[{"index":0,"delta":{"content":"Hi \"there\"\né"},"finish_reason":null}]})",
+                                  content));
+    CHECK_EQ(content, "Hi \"there\"\n\xc3\xa9");
+
+    std::string finish_reason;
+    CHECK_EQ(stream_content(R"({"choices":[{"index":0,"delta":{},"finish_reason":"stop"}]})", &finish_reason), "");
+    CHECK_EQ(finish_reason, "stop");
+
+    StreamDelta usage;
+    parse_stream_delta(R"({"choices":[],"usage":{"prompt_tokens":3,"completion_tokens":5}})", usage);
+    CHECK(usage.usage_chunk.contains(USAGE_KEY));
+}
+
+TEST(stream_delta_ignores_content_outside_the_delta) {
+    // A role-only delta followed by an object with its own "content" field
+    const std::string_view role_only =
+        R"({"choices":[{"index":0,"delta":{"role":"assistant"},"logprobs":{"content":"zzz"},"finish_reason":null}]})";
+    std::string content;
+    CHECK(!parse_stream_delta_fast(role_only, content));
+    CHECK_EQ(stream_content(role_only), "");
+
+    const std::string_view with_content =
+        R"({"choices":[{"index":0,"delta":{"content":"ok"},"logprobs":{"content":"zzz"},"finish_reason":null}]})";
+    CHECK_EQ(stream_content(with_content), "ok");
+}
+
+// Request bodies
+
+TEST(request_body_is_valid_json) {
+    const json body = json::parse(build_chat_request_body("gpt-4o", "sys \"quoted\"", "caf\xc3\xa9\n\x01", 100, true, {}, 0));
+    CHECK_EQ(body["model"], "gpt-4o");
+    CHECK_EQ(body["messages"].size(), 2u);
+    CHECK_EQ(body["messages"][0]["content"], "sys \"quoted\"");
+    CHECK_EQ(body["messages"][1]["content"], "caf\xc3\xa9\n\x01");
+    CHECK_EQ(body["max_tokens"], 100);
+    CHECK_EQ(body["temperature"], 0);
+    CHECK_EQ(body["stream"], true);
+    CHECK(body["stream_options"]["include_usage"] == true);
+}
+
+TEST(continuation_request_carries_the_partial_answer) {
+    const json body = json::parse(build_chat_request_body("o3-mini", "sys", "prompt", 50, true, "partial answer"));
+    CHECK_EQ(body["messages"].size(), 4u);
+    CHECK_EQ(body["messages"][2]["role"], "assistant");
+    CHECK_EQ(body["messages"][2]["content"], "partial answer");
+    CHECK_EQ(body["messages"][3]["content"], std::string(CONTINUATION_PROMPT));
+    // Reasoning models take max_completion_tokens instead of max_tokens
+    CHECK_EQ(body["max_completion_tokens"], 50);
+    CHECK(!body.contains("max_tokens"));
+    CHECK(!body.contains("temperature"));
+}
+
+// Fuzzy cache normalization
+
+TEST(timestamps_are_recognized) {
+    CHECK_EQ(timestamp_length("2024-01-05", 0), 10u);
+    CHECK_EQ(timestamp_length("2024/1/5 rest", 0), 8u);
+    CHECK_EQ(timestamp_length("5.1.2024", 0), 8u);
+    CHECK_EQ(timestamp_length("05/01/2024", 0), 10u);
+    CHECK_EQ(timestamp_length("2024-01-05T10:20:30Z", 0), 20u);
+    CHECK_EQ(timestamp_length("2024-01-05T10:20:30.123Z", 0), 24u);
+    CHECK_EQ(timestamp_length("2024-01-05 10:20 later", 0), 16u);
+    CHECK_EQ(timestamp_length("10:20:30", 0), 8u);
+    CHECK_EQ(timestamp_length("9:05:00.5", 0), 9u);
+}
+
+TEST(versions_verses_and_scores_are_not_timestamps) {
+    for (const char* text : {"2.0.10", "1.2.30", "1.2.2030.4", "3/4/25", "3:16", "12:30", "3:1", "100", "1.5",
+                             "16:9", "10.0.0.1"}) {
+        if (timestamp_length(text, 0) != 0) {
+            std::cerr << text << " taken as a timestamp\n";
+            CHECK(false);
+        }
+    }
+}
+
+TEST(prompt_numbers_keep_what_is_not_normalized) {
+    CHECK_EQ(prompt_numbers("What changed in libfoo 2.0.10?"), "2 0 10 ");
+    CHECK_EQ(prompt_numbers("Explain John 3:16"), "3 16 ");
+    CHECK_EQ(prompt_numbers("Errors at 2024-01-05T10:20:30Z and 11:00:00, code 42"), "42 ");
+}
+
+std::string make_temp_dir() {
+    const char* tmp = std::getenv("TMPDIR");
+    std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/cmdgpt_tests.XXXXXX";
+    if (!mkdtemp(&dir[0])) {
+        std::cerr << "Cannot create a temporary directory: " << std::strerror(errno) << '\n';
+        std::exit(EXIT_FAILURE);
+    }
+    return dir;
+}
+
+void remove_dir(const std::string& dir) {
+    const std::string command = "rm -rf '" + dir + "'";
+    CHECK_EQ(std::system(command.c_str()), 0);
+}
+
+// Stores each prompt with its own answer, then looks up the other prompt of each pair
+void check_no_fuzzy_false_positive(const char* cached, const char* asked) {
+    const std::string dir = make_temp_dir();
+    {
+        ResponseCache cache(dir, 0.95);
+        CHECK(cache.store("gpt-4o", "system", cached, std::string("answer to ") + cached, true));
+        CacheHit hit;
+        if (cache.lookup("gpt-4o", "system", asked, true, hit)) {
+            std::cerr << "\"" << asked << "\" was answered for \"" << cached << "\" (similarity " << hit.similarity << ")\n";
+            CHECK(false);
+        }
+    }
+    remove_dir(dir);
+}
+
+TEST(fuzzy_cache_keeps_versions_and_references_apart) {
+    check_no_fuzzy_false_positive("What changed in libfoo 2.0.10?", "What changed in libfoo 2.0.11?");
+    check_no_fuzzy_false_positive("What changed in libfoo 1.2.30?", "What changed in libfoo 1.2.31?");
+    check_no_fuzzy_false_positive("Explain the meaning of John 3:16 in detail", "Explain the meaning of John 3:17 in detail");
+    check_no_fuzzy_false_positive("The final score was 3:1, summarize the match", "The final score was 3:2, summarize the match");
+    check_no_fuzzy_false_positive("Convert 100 USD to EUR at today's rate", "Convert 250 USD to EUR at today's rate");
+}
+
+TEST(fuzzy_cache_matches_prompts_that_differ_in_timestamps) {
+    const std::string dir = make_temp_dir();
+    {
+        ResponseCache cache(dir, 0.95);
+        CHECK(cache.store("gpt-4o", "system", "Summarize the errors logged at 2024-01-05T10:20:30Z on the build server",
+                          "summary", true));
+        CacheHit hit;
+        CHECK(cache.lookup("gpt-4o", "system", "Summarize the errors logged at 2024-02-11T08:00:01Z on the build server",
+                           true, hit));
+        CHECK(hit.fuzzy);
+        CHECK_EQ(hit.response, "summary");
+        // Only answers at temperature 0 may answer a similar prompt
+        CHECK(!cache.lookup("gpt-4o", "system", "Summarize the errors logged at 2024-03-01T00:00:00Z on the build server",
+                            false, hit));
+    }
+    remove_dir(dir);
+}
+
+// Binary log
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::string& contents) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+}
+
+// Writes three blocks of three records each
+void write_test_log(const std::string& path) {
+    auto sink = std::make_shared<BinaryLogSink<std::mutex>>(path, DEFAULT_LOG_MAX_SIZE, DEFAULT_LOG_MAX_FILES);
+    spdlog::logger logger("log", sink);
+    for (int block = 0; block < 3; ++block) {
+        for (int record = 0; record < 3; ++record) {
+            logger.warn("block {} record {}", block, record);
+        }
+        logger.flush();
+    }
+}
+
+// Prints a log and returns the messages, one per line
+std::string logcat(const std::string& path, bool& complete) {
+    std::ostringstream out;
+    std::streambuf* const previous = std::cout.rdbuf(out.rdbuf());
+    std::streambuf* const previous_err = std::cerr.rdbuf(nullptr);
+    complete = print_binary_log(path);
+    std::cout.rdbuf(previous);
+    std::cerr.rdbuf(previous_err);
+    std::string messages;
+    std::istringstream lines(out.str());
+    for (std::string line; std::getline(lines, line);) {
+        messages += line.substr(line.find("] block") + 2) + '\n';
+    }
+    return messages;
+}
+
+std::string expected_log(std::initializer_list<int> blocks) {
+    std::string messages;
+    for (const int block : blocks) {
+        for (int record = 0; record < 3; ++record) {
+            messages += "block " + std::to_string(block) + " record " + std::to_string(record) + '\n';
+        }
+    }
+    return messages;
+}
+
+TEST(binary_log_round_trip) {
+    const std::string dir = make_temp_dir();
+    const std::string path = dir + "/log.bin";
+    write_test_log(path);
+    bool complete = false;
+    CHECK_EQ(logcat(path, complete), expected_log({0, 1, 2}));
+    CHECK(complete);
+    remove_dir(dir);
+}
+
+TEST(binary_log_resyncs_after_a_torn_block) {
+    const std::string dir = make_temp_dir();
+    const std::string path = dir + "/log.bin";
+    write_test_log(path);
+    const std::string log = read_file(path);
+    const std::string_view marker(LOG_BLOCK_MAGIC, sizeof(LOG_BLOCK_MAGIC));
+    const size_t second = log.find(marker, sizeof(BINARY_LOG_MAGIC) + 1);
+    const size_t third = log.find(marker, second + 1);
+    CHECK(second != std::string::npos && third != std::string::npos);
+
+    // Part of the second block is missing, as after a crash in the middle of a write
+    bool complete = true;
+    write_file(path, log.substr(0, second + 30) + log.substr(third));
+    CHECK_EQ(logcat(path, complete), expected_log({0, 2}));
+    CHECK(!complete);
+
+    // A flipped bit fails the checksum
+    std::string flipped = log;
+    flipped[second + sizeof(BinaryLogBlockHeader) + 5] ^= 0x10;
+    write_file(path, flipped);
+    CHECK_EQ(logcat(path, complete), expected_log({0, 2}));
+
+    // The last block is cut off
+    write_file(path, log.substr(0, log.size() - 7));
+    CHECK_EQ(logcat(path, complete), expected_log({0, 1}));
+    CHECK(!complete);
+    remove_dir(dir);
+}
+
+// Streamed output
+
+// Writes a hundred pieces through an OutputCoalescer into a file and returns the writes made
+uint64_t coalesce(const std::string& path, std::chrono::milliseconds max_latency, std::string& written) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    uint64_t writes = 0;
+    {
+        OutputCoalescer output(fd, max_latency);
+        for (int i = 0; i < 100; ++i) {
+            output.write("piece " + std::to_string(i) + '\n');
+        }
+        output.finish();
+        writes = output.writes();
+    }
+    close(fd);
+    written = read_file(path);
+    return writes;
+}
+
+TEST(output_coalescer_batches_pieces_in_order) {
+    std::string expected;
+    for (int i = 0; i < 100; ++i) {
+        expected += "piece " + std::to_string(i) + '\n';
+    }
+    const std::string dir = make_temp_dir();
+    std::string written;
+    // A file is not a terminal, so newlines do not force a write
+    CHECK_EQ(coalesce(dir + "/out", std::chrono::milliseconds(10000), written), 1u);
+    CHECK_EQ(written, expected);
+    CHECK_EQ(coalesce(dir + "/out", std::chrono::milliseconds(0), written), 100u);
+    CHECK_EQ(written, expected);
+    remove_dir(dir);
+}
+
+TEST(output_coalescer_bounds_the_delay) {
+    const std::string dir = make_temp_dir();
+    const std::string path = dir + "/out";
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    OutputCoalescer output(fd, std::chrono::milliseconds(20));
+    output.write("first");
+    // The background thread writes the piece without a further write() or finish()
+    for (int i = 0; i < 100 && read_file(path).empty(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK_EQ(read_file(path), "first");
+    output.finish();
+    close(fd);
+    remove_dir(dir);
+}
+
+// Usage ledger
+
+// Runs `cmdgpt usage` and returns the requests and prompt tokens of each row
+std::map<std::string, std::pair<uint64_t, uint64_t>> usage_report(const std::string& ledger, const char* group_by) {
+    std::ostringstream out;
+    std::streambuf* const previous = std::cout.rdbuf(out.rdbuf());
+    std::streambuf* const previous_err = std::cerr.rdbuf(nullptr);
+    char by[] = "--by";
+    std::string group(group_by);
+    char* argv[] = {by, group.data()};
+    const int result = run_usage_command(2, argv, ledger);
+    std::cout.rdbuf(previous);
+    std::cerr.rdbuf(previous_err);
+    std::map<std::string, std::pair<uint64_t, uint64_t>> rows;
+    if (result != EXIT_SUCCESS) {
+        return rows;
+    }
+    std::istringstream lines(out.str());
+    std::string line;
+    std::getline(lines, line);  // the heading
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        uint64_t requests = 0;
+        uint64_t prompt_tokens = 0;
+        fields >> name >> requests >> prompt_tokens;
+        rows[name] = {requests, prompt_tokens};
+    }
+    return rows;
+}
+
+TEST(ledger_records_and_totals) {
+    const std::string dir = make_temp_dir();
+    const std::string path = dir + "/usage.ledger";
+    UsageLedger ledger(path, "project");
+    CHECK(ledger.record("gpt-4o", 1000, 200, 400, std::chrono::milliseconds(300)));
+    CHECK(ledger.record("gpt-4o-mini", 50, 10, 0, std::chrono::milliseconds(100)));
+    CHECK_EQ(read_file(path).size(), sizeof(LedgerHeader) + 2 * sizeof(LedgerRecord));
+
+    const UsageTotals totals = ledger.totals();
+    CHECK_EQ(totals.requests, 2u);
+    CHECK_EQ(totals.prompt_tokens, 1050u);
+    CHECK_EQ(totals.completion_tokens, 210u);
+    CHECK_EQ(totals.cached_tokens, 400u);
+    CHECK_EQ(totals.latency_ms, 400u);
+    CHECK_EQ(totals.cost_micro_usd, estimate_cost_micro_usd("gpt-4o", 1000, 400, 200) +
+                                        estimate_cost_micro_usd("gpt-4o-mini", 50, 0, 10));
+
+    auto rows = usage_report(path, "model");
+    CHECK_EQ(rows.size(), 3u);
+    CHECK(rows["gpt-4o"] == std::make_pair(uint64_t{1}, uint64_t{1000}));
+    CHECK(rows["gpt-4o-mini"] == std::make_pair(uint64_t{1}, uint64_t{50}));
+    CHECK(rows["TOTAL"] == std::make_pair(uint64_t{2}, uint64_t{1050}));
+    rows = usage_report(path, "tag");
+    CHECK(rows["project"] == std::make_pair(uint64_t{2}, uint64_t{1050}));
+    remove_dir(dir);
+}
+
+TEST(ledger_torn_record_is_dropped) {
+    const std::string dir = make_temp_dir();
+    const std::string path = dir + "/usage.ledger";
+    UsageLedger ledger(path, "");
+    CHECK(ledger.record("gpt-4o", 10, 1, 0, std::chrono::milliseconds(1)));
+    // Part of a record left by an interrupted writer
+    write_file(path, read_file(path) + std::string(40, '\x7f'));
+    CHECK(ledger.record("gpt-4o", 20, 2, 0, std::chrono::milliseconds(1)));
+    CHECK_EQ(read_file(path).size(), sizeof(LedgerHeader) + 2 * sizeof(LedgerRecord));
+    auto rows = usage_report(path, "model");
+    CHECK(rows["TOTAL"] == std::make_pair(uint64_t{2}, uint64_t{30}));
+
+    // A file that is not a ledger is refused rather than misread
+    write_file(path, std::string(sizeof(LedgerHeader) + sizeof(LedgerRecord), 'x'));
+    CHECK(usage_report(path, "model").empty());
+    remove_dir(dir);
+}
+
+TEST(ledger_counts_saturate_instead_of_wrapping) {
+    const std::string dir = make_temp_dir();
+    UsageLedger ledger(dir + "/usage.ledger", "");
+    const uint64_t huge = uint64_t{1} << 33;
+    CHECK(ledger.record("gpt-4o", huge, 5, 0, std::chrono::milliseconds(1)));
+    CHECK_EQ(ledger.totals().prompt_tokens, uint64_t{std::numeric_limits<uint32_t>::max()});
+    CHECK_EQ(ledger.totals().cost_micro_usd, estimate_cost_micro_usd("gpt-4o", huge, 0, 5));
+    remove_dir(dir);
+}
+
+// Budget
+
+TEST(prompt_token_estimate_errs_high) {
+    // 11 tokens of framing for two messages; 37 ASCII bytes at 3 per token
+    CHECK_EQ(estimate_prompt_tokens({"", "How many tokens does this prompt use?"}), 11u + 13u);
+    // Two bytes per token for other UTF-8 text: 15 bytes of Japanese are 8 tokens
+    CHECK_EQ(estimate_prompt_tokens({"", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xa7\xe3\x81\x99"}), 11u + 8u);
+}
+
+TEST(cost_budget_refuses_models_without_a_price) {
+    const UsageBudget saved = gBudget;
+    gBudget = UsageBudget();
+    gBudget.max_cost_micro_usd = 1000000;
+    uint64_t max_tokens = 0;
+    CHECK(check_budget("gpt-5-mini", 100, max_tokens));
+    CHECK(max_tokens > 0);
+    CHECK(find_model_price("o3-2025-04-16") && find_model_price("o3-2025-04-16")->output == 8.00);
+    CHECK(find_model_price("o4-mini") && find_model_price("o4-mini")->input == 1.10);
+    CHECK(!check_budget("some-local-model", 100, max_tokens));
+
+    // A token budget alone needs no price
+    gBudget = UsageBudget();
+    gBudget.max_tokens_total = 1000;
+    CHECK(check_budget("some-local-model", 100, max_tokens));
+    CHECK_EQ(max_tokens, 900u);
+    gBudget = saved;
+}
+
+TEST(usage_counts_are_not_truncated) {
+    const UsageBudget saved = gBudget;
+    gBudget = UsageBudget();
+    const json response = {{"model", "gpt-4o"},
+                           {"usage", {{"prompt_tokens", uint64_t{1} << 32}, {"completion_tokens", 7u},
+                                      {"prompt_tokens_details", {{"cached_tokens", -3}}}}}};
+    account_usage(response, "gpt-4o", std::chrono::milliseconds(1));
+    CHECK_EQ(gBudget.used_tokens, (uint64_t{1} << 32) + 7);
+    CHECK_EQ(gBudget.requests, 1u);
+    gBudget = saved;
+}
+
+// Response cache files
+
+// Runs a command function with its standard output discarded
+template <typename Function>
+int quietly(Function&& function) {
+    std::ostringstream out;
+    std::streambuf* const previous = std::cout.rdbuf(out.rdbuf());
+    const int result = function();
+    std::cout.rdbuf(previous);
+    return result;
+}
+
+CacheEntry make_entry(const std::string& prompt, const std::string& response) {
+    CacheEntry entry;
+    entry.model = "gpt-4o";
+    entry.system_prompt = "system";
+    entry.prompt = prompt;
+    entry.response = response;
+    entry.deterministic = true;
+    entry.valid = true;
+    return entry;
+}
+
+std::string lookup_exact(ResponseCache& cache, const std::string& prompt) {
+    CacheHit hit;
+    return cache.lookup("gpt-4o", "system", prompt, true, hit) && !hit.fuzzy ? hit.response : "<miss>";
+}
+
+TEST(cache_entries_survive_reopening) {
+    const std::string dir = make_temp_dir();
+    {
+        ResponseCache cache(dir);
+        CHECK(cache.store("gpt-4o", "system", "first", "answer 1", true));
+        CHECK(cache.store("gpt-4o", "system", "second", std::string(5000, 'x'), false));
+    }
+    ResponseCache cache(dir);
+    CHECK_EQ(lookup_exact(cache, "first"), "answer 1");
+    CHECK_EQ(lookup_exact(cache, "second"), std::string(5000, 'x'));
+    CHECK_EQ(lookup_exact(cache, "third"), "<miss>");
+    // The key covers the model and the system prompt too
+    CacheHit hit;
+    CHECK(!cache.lookup("gpt-4", "system", "first", true, hit));
+    CHECK(!cache.lookup("gpt-4o", "other", "first", true, hit));
+
+    std::vector<CacheEntry> entries;
+    CHECK(cache.read_all(entries));
+    CHECK_EQ(entries.size(), 2u);
+    CHECK(entries.size() == 2 && entries[0].deterministic && !entries[1].deterministic);
+    remove_dir(dir);
+}
+
+TEST(cache_store_all_skips_duplicates) {
+    const std::string dir = make_temp_dir();
+    ResponseCache cache(dir);
+    CHECK(cache.store("gpt-4o", "system", "cached", "old", true));
+    const std::vector<CacheEntry> batch = {make_entry("new", "first"), make_entry("cached", "ignored"),
+                                           make_entry("new", "second"), make_entry("other", "third")};
+    size_t added = 0;
+    size_t duplicates = 0;
+    CHECK(cache.store_all(batch, added, duplicates));
+    CHECK_EQ(added, 2u);
+    CHECK_EQ(duplicates, 2u);
+    // The first occurrence and the answer cached already win
+    CHECK_EQ(lookup_exact(cache, "new"), "first");
+    CHECK_EQ(lookup_exact(cache, "cached"), "old");
+    CHECK_EQ(lookup_exact(cache, "other"), "third");
+    remove_dir(dir);
+}
+
+TEST(cache_torn_index_entry_is_dropped) {
+    const std::string dir = make_temp_dir();
+    {
+        ResponseCache cache(dir);
+        CHECK(cache.store("gpt-4o", "system", "first", "answer 1", true));
+    }
+    // An interrupted writer left part of an index entry behind
+    const std::string index = read_file(dir + CACHE_INDEX_FILE);
+    write_file(dir + CACHE_INDEX_FILE, index + std::string(sizeof(CacheIndexEntry) / 2, '\x7f'));
+    ResponseCache cache(dir);
+    CHECK(cache.store("gpt-4o", "system", "second", "answer 2", true));
+    CHECK_EQ(read_file(dir + CACHE_INDEX_FILE).size(), index.size() + sizeof(CacheIndexEntry));
+    CHECK_EQ(lookup_exact(cache, "first"), "answer 1");
+    CHECK_EQ(lookup_exact(cache, "second"), "answer 2");
+    remove_dir(dir);
+}
+
+#ifdef CMDGPT_WITH_ZSTD
+TEST(cache_dictionary_compression_round_trip) {
+    const std::string dir = make_temp_dir();
+    std::vector<CacheEntry> batch;
+    for (int i = 0; i < 2000; ++i) {
+        batch.push_back(make_entry("question " + std::to_string(i),
+                                   "Certainly! Here is a detailed answer to question " + std::to_string(i) +
+                                       ". First, consider the context and the constraints. Then apply step " +
+                                       std::to_string(i % 7) + " and verify the result " + std::to_string(i * 31) + "."));
+    }
+    {
+        ResponseCache cache(dir);
+        size_t added = 0;
+        size_t duplicates = 0;
+        CHECK(cache.store_all(batch, added, duplicates));
+        CHECK_EQ(quietly([&cache] { return train_cache_dictionary(cache, 16 * 1024); }), EXIT_SUCCESS);
+    }
+    // Entries compressed without and with the dictionary are both readable
+    ResponseCache cache(dir);
+    CHECK(cache.store("gpt-4o", "system", "after training", batch[5].response, true));
+    std::vector<CacheEntry> entries;
+    CHECK(cache.read_all(entries));
+    CHECK_EQ(entries.size(), batch.size() + 1);
+    std::map<std::string, std::string> responses;
+    for (const CacheEntry& entry : entries) {
+        CHECK(entry.valid);
+        responses[entry.prompt] = entry.response;
+    }
+    for (const CacheEntry& entry : batch) {
+        if (responses[entry.prompt] != entry.response) {
+            std::cerr << "the answer to " << entry.prompt << " differs\n";
+            CHECK(false);
+            break;
+        }
+    }
+    CHECK_EQ(lookup_exact(cache, "after training"), batch[5].response);
+    remove_dir(dir);
+}
+#endif
+
+TEST(cache_import_reads_pipes) {
+    const std::string dir = make_temp_dir();
+    const std::string fifo = dir + "/input.fifo";
+    CHECK_EQ(mkfifo(fifo.c_str(), 0600), 0);
+    std::thread writer([&fifo] {
+        std::ofstream out(fifo);
+        out << R"({"prompt":"a","response":"1"})" << '\n'
+            << R"({"prompt":"b","response":"2","model":null})" << '\n'
+            << R"({"prompt":"c","response":"3","temperature":0})" << '\n';
+    });
+    ResponseCache cache(dir + "/cache");
+    CHECK_EQ(quietly([&] { return import_cache(cache, {fifo}, "gpt-4o", "system"); }), EXIT_SUCCESS);
+    writer.join();
+    CHECK_EQ(lookup_exact(cache, "a"), "1");
+    CHECK_EQ(lookup_exact(cache, "b"), "<miss>");   // an invalid line
+    CHECK_EQ(lookup_exact(cache, "c"), "3");
+    std::vector<CacheEntry> entries;
+    CHECK(cache.read_all(entries));
+    CHECK_EQ(entries.size(), 2u);
+    remove_dir(dir);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    gLogger = std::make_shared<spdlog::logger>("tests", std::make_shared<spdlog::sinks::null_sink_mt>());
+    size_t run = 0;
+    for (const TestCase& test : test_cases()) {
+        if (argc > 1 && std::find_if(argv + 1, argv + argc, [&test](const char* name) {
+                            return std::strcmp(name, test.name) == 0;
+                        }) == argv + argc) {
+            continue;
+        }
+        const int failures_before = failures;
+        test.run();
+        std::cout << (failures == failures_before ? "PASS " : "FAIL ") << test.name << '\n';
+        ++run;
+    }
+    std::cout << run << " tests, " << failures << " failed checks\n";
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}